@@ -0,0 +1,294 @@
+/**
+ * Nucular Keyboard - USB CDC-ACM serial console
+ * Copyright (C)2015 Thomas Kindler <mail_nucular@t-kindler.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cdc_console.h"
+#include "usbd_hid.h"
+
+#if USB_CDC_CONSOLE
+
+#include "debounce.h"
+#include "kb_driver.h"
+#include "keyboard.h"
+#include "telemetry.h"
+#include "ps2_host.h"
+#include "trackpoint.h"
+#include "ringbuf.h"
+#include "stats.h"
+#include "ustime.h"
+#include "util.h"
+#include "stm32l0xx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Output is sent from the USB interrupt, so printf never waits for
+// the host.  If the buffer is full, output is dropped and counted.
+//
+
+struct cdc_console_stats cdc_console_stats;
+
+static struct ringbuf  tx_buf = RINGBUF(CDC_TX_BUFFER_SIZE);
+static struct ringbuf  rx_buf = RINGBUF(CDC_RX_BUFFER_SIZE);
+
+static char  line[CDC_LINE_MAX];
+static int   line_len;
+
+static uint32_t  bench_left;     // bytes still to write, 0: not running
+static uint32_t  bench_size;
+static uint32_t  bench_start;
+
+
+#undef putchar
+
+int putchar(int c)
+{
+    int ret = -1;
+
+    // tx_buf needs locking if there are multiple writers
+    //
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    // Terminals expect CR LF
+    //
+    if (rb_bytes_free(&tx_buf) >= (c == '\n' ? 2 : 1)) {
+        if (c == '\n')
+            rb_putchar(&tx_buf, '\r');
+
+        ret = rb_putchar(&tx_buf, c);
+    }
+    else {
+        cdc_console_stats.tx_dropped++;
+    }
+
+    __set_PRIMASK(primask);
+    return ret;
+}
+
+
+int cdc_console_tx(void *buf, int size)
+{
+    int len = rb_read(&tx_buf, buf, size);
+
+    cdc_console_stats.tx_bytes += len;
+    return len;
+}
+
+
+int cdc_console_tx_pending(void)
+{
+    return rb_bytes_used(&tx_buf);
+}
+
+
+void cdc_console_rx(const void *buf, int len)
+{
+    int n = rb_write(&rx_buf, buf, len);
+
+    cdc_console_stats.rx_bytes += n;
+    cdc_console_stats.rx_dropped += len - n;
+}
+
+
+int cdc_console_rx_free(void)
+{
+    return rb_bytes_free(&rx_buf);
+}
+
+
+static void cmd_help(int argc, char **argv);
+
+
+static void cmd_stats(int argc, char **argv)
+{
+    stats_print();
+}
+
+
+static void cmd_clear(int argc, char **argv)
+{
+    stats_clear();
+}
+
+
+static void cmd_debounce(int argc, char **argv)
+{
+    if (argc == 4) {
+        debounce_configure(
+            strtol(argv[1], NULL, 0), strtol(argv[2], NULL, 0), strtol(argv[3], NULL, 0)
+        );
+    }
+    else if (argc != 1) {
+        printf("usage: debounce [mode samples hold-off]\n");
+        return;
+    }
+
+    printf("debounce: mode %d, samples %d, hold-off %d\n",
+        debounce_get_mode(), debounce_get_samples(), debounce_get_holdoff()
+    );
+}
+
+
+static void cmd_bench(int argc, char **argv)
+{
+    int kbytes = argc > 1 ? strtol(argv[1], NULL, 0) : 64;
+
+    bench_size  = kbytes * 1024;
+    bench_left  = bench_size;
+    bench_start = get_us_time32();
+}
+
+
+static void cmd_boot(int argc, char **argv)
+{
+    enter_bootloader();
+}
+
+
+static const struct {
+    const char *name;
+    void      (*func)(int argc, char **argv);
+    const char *help;
+} commands[] = {
+    { "help",       cmd_help,       "list commands" },
+    { "stats",      cmd_stats,      "dump counters" },
+    { "clear",      cmd_clear,      "reset counters" },
+    { "debounce",   cmd_debounce,   "[mode samples hold-off]  show or change debouncing" },
+    { "bench",      cmd_bench,      "[kbytes]  measure console throughput" },
+    { "boot",       cmd_boot,       "enter the bootloader" }
+};
+
+
+static void cmd_help(int argc, char **argv)
+{
+    for (int i=0; i<ARRAY_SIZE(commands); i++)
+        printf("%-10s %s\n", commands[i].name, commands[i].help);
+}
+
+
+static void execute(char *s)
+{
+    char *argv[6];
+    int  argc = 0;
+
+    while (argc < 6) {
+        while (*s == ' ')
+            *s++ = '\0';
+
+        if (!*s)
+            break;
+
+        argv[argc++] = s;
+
+        while (*s && *s != ' ')
+            s++;
+    }
+
+    if (argc == 0)
+        return;
+
+    for (int i=0; i<ARRAY_SIZE(commands); i++) {
+        if (!strcmp(argv[0], commands[i].name)) {
+            commands[i].func(argc, argv);
+            return;
+        }
+    }
+
+    printf("unknown command: %s\n", argv[0]);
+}
+
+
+/**
+ * Write the benchmark pattern as fast as the host takes it.
+ *
+ * Runs from the main loop, a little at a time, so the keyboard keeps
+ * working while the benchmark is running.
+ */
+static void bench_update(void)
+{
+    static const char pattern[] =
+        "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\r\n";
+
+    while (bench_left) {
+        int len = MIN(bench_left, sizeof(pattern) - 1);
+
+        __disable_irq();
+        int ok = rb_bytes_free(&tx_buf) >= len;
+        if (ok)
+            rb_write(&tx_buf, pattern, len);
+        __enable_irq();
+
+        if (!ok)
+            return;
+
+        bench_left -= len;
+    }
+
+    if (bench_size && !cdc_console_tx_pending()) {
+        uint32_t dt = get_us_time32() - bench_start;
+
+        printf("bench: %lu bytes in %lu us, %lu KB/s\n",
+            bench_size, dt, (uint32_t)((uint64_t)bench_size * 1000000 / 1024 / dt));
+
+        bench_size = 0;
+    }
+}
+
+
+/**
+ * Handle console input.
+ *
+ * Call this from the main loop.  Input is echoed, and complete lines
+ * are executed as commands.
+ */
+void cdc_console_update(void)
+{
+    int c;
+
+    bench_update();
+
+    while ((c = rb_getchar(&rx_buf)) >= 0) {
+        switch (c) {
+        case '\r':
+        case '\n':
+            if (line_len) {
+                putchar('\n');
+                line[line_len] = '\0';
+                line_len = 0;
+                execute(line);
+            }
+            break;
+
+        case '\b':
+        case 0x7F:
+            if (line_len) {
+                line_len--;
+                printf("\b \b");
+            }
+            break;
+
+        default:
+            if (c >= ' ' && line_len < CDC_LINE_MAX - 1) {
+                line[line_len++] = c;
+                putchar(c);
+            }
+            break;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#define CDC_TX_BUFFER_SIZE  1024
+#define CDC_RX_BUFFER_SIZE  128
+#define CDC_LINE_MAX        64
+
+struct cdc_console_stats {
+    uint32_t tx_bytes;      // bytes handed to the USB endpoint
+    uint32_t tx_dropped;    // output bytes lost because the buffer was full
+    uint32_t rx_bytes;      // bytes received from the host
+    uint32_t rx_dropped;    // input bytes lost because the buffer was full
+};
+
+extern struct cdc_console_stats cdc_console_stats;
+
+// Called from the USB interrupt
+//
+int  cdc_console_tx(void *buf, int size);
+int  cdc_console_tx_pending(void);
+void cdc_console_rx(const void *buf, int len);
+int  cdc_console_rx_free(void);
+
+void cdc_console_update(void);
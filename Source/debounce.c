@@ -0,0 +1,176 @@
+/**
+ * Nucular Keyboard - Key matrix debouncing
+ * Copyright (C)2015 Thomas Kindler <mail_nucular@t-kindler.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+    Vertical counter debouncing, see
+    http://www.compuphase.com/electronics/debouncing.htm
+
+    Every key has a 4 bit counter, stored as bit planes.  A counter
+    increments while the raw key differs from the debounced state, and
+    is reset as soon as it agrees again.  When it reaches the configured
+    number of samples, the debounced state toggles.
+
+    In eager mode, a press is reported on the first sample.  The key is
+    then locked for the hold-off time, and its counter just counts scans.
+    Releases still have to be stable for the configured number of samples.
+
+    The 16 x 8 matrix is processed as 4 words, so every operation
+    handles 32 keys at once and the run time does not depend on the
+    number of keys pressed.
+*/
+
+#include "debounce.h"
+#include "ustime.h"
+#include "util.h"
+#include <string.h>
+
+#define COUNTER_BITS    4       // enough for DEBOUNCE_MAX_SAMPLES
+#define MATRIX_WORDS    4       // 16 bytes
+
+static uint32_t state[MATRIX_WORDS];
+static uint32_t locked[MATRIX_WORDS];
+static uint32_t counter[COUNTER_BITS][MATRIX_WORDS];
+
+static int mode    = DEBOUNCE_MODE;
+static int samples = DEBOUNCE_SAMPLES;
+static int holdoff = DEBOUNCE_HOLDOFF;
+
+struct debounce_stats debounce_stats;
+
+
+void debounce_configure(int new_mode, int new_samples, int new_holdoff)
+{
+    mode    = new_mode == DEBOUNCE_EAGER ? DEBOUNCE_EAGER : DEBOUNCE_SYMMETRIC;
+    samples = clamp(new_samples, 1, DEBOUNCE_MAX_SAMPLES);
+    holdoff = clamp(new_holdoff, 1, DEBOUNCE_MAX_SAMPLES);
+
+    memset(locked, 0, sizeof(locked));
+    memset(counter, 0, sizeof(counter));
+}
+
+
+int debounce_get_mode(void)
+{
+    return mode;
+}
+
+
+int debounce_get_samples(void)
+{
+    return samples;
+}
+
+
+int debounce_get_holdoff(void)
+{
+    return holdoff;
+}
+
+
+// Increment counters of the keys in mask, reset all others
+//
+static inline void count(int i, uint32_t mask)
+{
+    uint32_t carry = mask;
+
+    for (int b=0; b<COUNTER_BITS; b++) {
+        uint32_t c = counter[b][i] & mask;
+
+        counter[b][i] = c ^ carry;
+        carry &= c;
+    }
+}
+
+
+// Get keys whose counter equals n
+//
+static inline uint32_t count_equals(int i, int n)
+{
+    uint32_t match = ~0;
+
+    for (int b=0; b<COUNTER_BITS; b++)
+        match &= (n & (1 << b)) ? counter[b][i] : ~counter[b][i];
+
+    return match;
+}
+
+
+// Reset counters of the keys in mask
+//
+static inline void count_reset(int i, uint32_t mask)
+{
+    for (int b=0; b<COUNTER_BITS; b++)
+        counter[b][i] &= ~mask;
+}
+
+
+/**
+ * Debounce a matrix frame.
+ *
+ * \param  matrix  16 raw sense bytes, replaced by the debounced state
+ */
+void debounce(uint8_t *matrix)
+{
+    uint32_t t0 = get_cycles();
+    uint32_t raw[MATRIX_WORDS];
+
+    // matrix may not be word aligned
+    //
+    memcpy(raw, matrix, sizeof(raw));
+
+    if (mode == DEBOUNCE_EAGER) {
+        for (int i=0; i<MATRIX_WORDS; i++) {
+            uint32_t delta = raw[i] ^ state[i];
+            uint32_t press = delta & raw[i];
+
+            // locked keys count scans, released keys count stable samples
+            //
+            count(i, locked[i] | (delta & ~raw[i]));
+
+            uint32_t unlock  =  locked[i] & count_equals(i, holdoff);
+            uint32_t release = ~locked[i] & delta & ~raw[i] & count_equals(i, samples);
+
+            state[i]  = (state[i] | press) & ~release;
+            locked[i] = (locked[i] & ~unlock) | press;
+
+            count_reset(i, unlock | release);
+        }
+    }
+    else {
+        for (int i=0; i<MATRIX_WORDS; i++) {
+            uint32_t delta = raw[i] ^ state[i];
+
+            // toggle keys that have been stable for long enough
+            //
+            count(i, delta);
+
+            uint32_t match = delta & count_equals(i, samples);
+
+            state[i] ^= match;
+            count_reset(i, match);
+        }
+    }
+
+    memcpy(matrix, state, sizeof(state));
+
+    uint32_t dt = get_cycles_since(t0);
+
+    debounce_stats.cycles = dt;
+    if (dt > debounce_stats.cycles_max)
+        debounce_stats.cycles_max = dt;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+// Debounce modes
+//
+#define DEBOUNCE_SYMMETRIC      0       // presses and releases must be stable
+#define DEBOUNCE_EAGER          1       // report presses immediately, then hold off
+
+#ifndef DEBOUNCE_MODE
+#define DEBOUNCE_MODE           DEBOUNCE_SYMMETRIC
+#endif
+
+#define DEBOUNCE_SAMPLES        4       // default, 1..DEBOUNCE_MAX_SAMPLES
+#define DEBOUNCE_HOLDOFF        4       // default, 1..DEBOUNCE_MAX_SAMPLES
+#define DEBOUNCE_MAX_SAMPLES    15
+
+struct debounce_stats {
+    uint32_t cycles;        // CPU cycles of last debounce() call
+    uint32_t cycles_max;    // .. and worst case
+};
+
+extern struct debounce_stats debounce_stats;
+
+void debounce_configure(int mode, int samples, int holdoff);
+
+int  debounce_get_mode(void);
+int  debounce_get_samples(void);
+int  debounce_get_holdoff(void);
+
+void debounce(uint8_t *matrix);
@@ -20,6 +20,8 @@
 #include "usbd_hid.h"
 #include "stm32l0xx.h"
 
+#if !USB_CDC_CONSOLE
+
 #define HID_DEBUG_TIMEOUT   (HID_DEBUG_POLLING_INTERVAL * 2)
 
 
@@ -95,3 +97,5 @@ void hid_debug_flush(void)
     if (USBD_HID_SendReport(&hUsbDeviceFS, HID_DEBUG_EPIN_ADDR, &report, sizeof(report)) == USBD_OK)
         rb_commit(&tx_buf, RB_READ, len);
 }
+
+#endif
@@ -16,11 +16,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "kb_driver.h"
+#include "telemetry.h"
 #include "ustime.h"
 #include "util.h"
 #include "gamma_tab.inc"
 #include "stm32l0xx_hal.h"
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
 
 
 // If you ever change the pinout, print this stuff out and tick it off with a pencil..
@@ -72,28 +75,34 @@ static void discharge(void)
 }
 
 
+static const struct {
+    GPIO_TypeDef    *port;
+    uint16_t        pin;
+} drv_lines[16] = {
+    { GPIOC, GPIO_PIN_9  },     //  0
+    { GPIOC, GPIO_PIN_7  },     //  1
+    { GPIOB, GPIO_PIN_15 },     //  2
+    { GPIOB, GPIO_PIN_13 },     //  3
+    { GPIOB, GPIO_PIN_0  },     //  4
+    { GPIOB, GPIO_PIN_1  },     //  5
+    { GPIOB, GPIO_PIN_12 },     //  6
+    { GPIOB, GPIO_PIN_14 },     //  7
+    { GPIOB, GPIO_PIN_2  },     //  8
+    { GPIOC, GPIO_PIN_8  },     //  9
+    { GPIOC, GPIO_PIN_6  },     // 10
+    { GPIOA, GPIO_PIN_8  },     // 11
+    { GPIOC, GPIO_PIN_10 },     // 12
+    { GPIOD, GPIO_PIN_2  },     // 13
+    { GPIOA, GPIO_PIN_10 },     // 14
+    { GPIOC, GPIO_PIN_12 }      // 15
+};
+
+
 static void set_drv(int d)
 {
     // set active line low
     //
-    switch (d) {
-    case  0: GPIOC->BRR = GPIO_PIN_9;   break;
-    case  1: GPIOC->BRR = GPIO_PIN_7;   break;
-    case  2: GPIOB->BRR = GPIO_PIN_15;  break;
-    case  3: GPIOB->BRR = GPIO_PIN_13;  break;
-    case  4: GPIOB->BRR = GPIO_PIN_0;   break;
-    case  5: GPIOB->BRR = GPIO_PIN_1;   break;
-    case  6: GPIOB->BRR = GPIO_PIN_12;  break;
-    case  7: GPIOB->BRR = GPIO_PIN_14;  break;
-    case  8: GPIOB->BRR = GPIO_PIN_2;   break;
-    case  9: GPIOC->BRR = GPIO_PIN_8;   break;
-    case 10: GPIOC->BRR = GPIO_PIN_6;   break;
-    case 11: GPIOA->BRR = GPIO_PIN_8;   break;
-    case 12: GPIOC->BRR = GPIO_PIN_10;  break;
-    case 13: GPIOD->BRR = GPIO_PIN_2;   break;
-    case 14: GPIOA->BRR = GPIO_PIN_10;  break;
-    case 15: GPIOC->BRR = GPIO_PIN_12;  break;
-    }
+    drv_lines[d].port->BRR = drv_lines[d].pin;
 }
 
 
@@ -113,33 +122,642 @@ static uint8_t get_sense(void)
 }
 
 
-int kb_scan_matrix(uint8_t *matrix)
+// Background matrix scanner
+//
+// LPTIM1 runs continuously from PCLK with a period of SCAN_INTERVAL_US.
+// The auto-reload match starts a new frame, and each compare match samples
+// the current drive line and activates the next one.  Completed frames are
+// double-buffered, so the main loop only has to pick them up.
+//
+// After SCAN_IDLE_FRAMES empty frames, the scanner pulls all drive lines
+// low at once and stops scanning until a sense line goes low.  The sense
+// lines without EXTI are polled every SCAN_IDLE_POLL_US meanwhile.
+//
+// While the USB bus is suspended, LPTIM1 is switched to the LSI, so it
+// keeps polling the sense lines in Stop mode.  A key press then only
+// raises a wake-up request for the main loop.
+//
+#define SCAN_INTERVAL_US    1000    // 1 kHz frame rate
+#define SCAN_SETTLE_US      3       // default, if calibration fails
+#define SCAN_IDLE_FRAMES    500     // 0.5s
+#define SCAN_IDLE_POLL_US   10000   // sense line polling in idle mode
+#define SCAN_IDLE_PRESC     128     // LPTIM_CFGR_PRESC in idle mode
+#define SCAN_SUSPEND_POLL_MS  20    // sense line polling in Stop mode
+#define SCAN_LSI_HZ         37000   // nominal, 26..56 kHz
+
+// Frames are phase-locked to the USB SOF, so that a scan has been
+// processed just before the host polls the endpoints of the next frame.
+//
+#define SCAN_SOF_LEAD_US    300     // start frames this long before SOF
+
+// Settle time calibration
+//
+#define CAL_SAMPLES         16      // measurements per drive line
+#define CAL_TIMEOUT         1000    // loop iterations
+#define CAL_MARGIN          2       // safety factor
+#define CAL_MIN_NS          500     // CMP must be ahead of CNT when written
+
+// Sense lines that can wake us up via EXTI.  PH0/PH1 share EXTI0/1 with
+// PC0/PC1, and EXTI3 is used by the PS/2 clock on PB3.  These three lines
+// are polled in idle mode.  EXTI2 shares its vector with the PS/2 driver,
+// which calls kb_sense_irq().
+//
+#define EXTI_SENSE_BITS     (GPIO_PIN_0 | GPIO_PIN_1 | GPIO_PIN_2 | GPIO_PIN_13 | GPIO_PIN_15)
+
+static uint8_t  scan_buf[2][16];
+static uint32_t scan_end_time[2];   // us timestamp of each buffer
+static int      scan_back;          // buffer currently being filled
+static int      scan_row = 16;      // 16: waiting for next frame
+
+static volatile uint32_t scan_seq;  // number of completed frames
+static uint32_t scan_seq_read;
+
+static uint16_t scan_settle_ticks[16];
+static uint16_t scan_period_ticks;
+static uint16_t scan_idle_ticks;    // with SCAN_IDLE_PRESC
+static uint16_t scan_ticks_per_us;
+
+static uint16_t scan_sof_lead_ticks;
+static volatile int16_t scan_adjust_ticks;  // correction for the next period
+static bool     scan_period_adjusted;
+
+static uint16_t scan_start_cnt;
+static volatile uint16_t scan_time_ticks;
+
+static volatile bool scan_idle;
+static int      scan_empty_frames;
+static bool     scan_woken;         // current frame was started by a wake-up
+
+static volatile bool     scan_wake_pending;
+static volatile uint32_t scan_wake_time;
+
+static volatile bool     scan_suspended;
+static volatile bool     scan_wake_request;    // key pressed while suspended
+static uint32_t          scan_led_ccer[3];     // LED outputs before suspend
+
+struct kb_scan_stats kb_scan_stats;
+
+
+static void scan_start_timer(uint32_t clksel, uint32_t cfgr, uint32_t ier, uint32_t period);
+
+
+static void scan_start_row(int row)
 {
-    // scan drive lines: ~180 us
+    discharge();
+    set_drv(row);
+
+    // CNT can be read directly, because the LPTIM
+    // runs synchronously to the APB clock.
     //
-    for (int i=0; i<16; i++) {
+    uint32_t cnt = LPTIM1->CNT;
+    if (row == 0)
+        scan_start_cnt = cnt;
+
+    // The SOF lock changes ARR, so wrap against the current period
+    //
+    uint32_t period = LPTIM1->ARR + 1;
+    uint32_t cmp = cnt + scan_settle_ticks[row];
+    if (cmp >= period)
+        cmp -= period;
+
+    LPTIM1->CMP = cmp;
+}
+
+
+static void scan_enter_idle(void)
+{
+    // pull all drive lines low, so that any
+    // key will pull its sense line low.
+    //
+    GPIOA->BRR = GPIOA_DRV_BITS;
+    GPIOB->BRR = GPIOB_DRV_BITS;
+    GPIOC->BRR = GPIOC_DRV_BITS;
+    GPIOD->BRR = GPIOD_DRV_BITS;
+
+    EXTI->PR   = EXTI_SENSE_BITS;
+    EXTI->IMR |= EXTI_SENSE_BITS;
+
+    scan_idle = true;
+    scan_wake_pending = false;
+}
+
+
+static void scan_exit_idle(void)
+{
+    EXTI->IMR &= ~EXTI_SENSE_BITS;
+
+    scan_idle = false;
+    scan_empty_frames = 0;
+
+    // back to the full frame rate
+    //
+    scan_adjust_ticks = 0;
+    scan_period_adjusted = false;
+    scan_start_timer(0, 0, LPTIM_IER_CMPMIE | LPTIM_IER_ARRMIE, scan_period_ticks);
+
+    scan_wake_time = get_us_time32();
+    scan_wake_pending = true;
+    kb_scan_stats.wakeups++;
+
+    // start a full frame right away
+    //
+    scan_woken = true;
+    scan_row = 0;
+    scan_start_row(0);
+}
+
+
+static void scan_wake(void)
+{
+    if (scan_suspended)
+        scan_wake_request = true;
+    else
+        scan_exit_idle();
+}
+
+
+static void scan_end_frame(void)
+{
+    discharge();
+
+    int dt = LPTIM1->CNT - scan_start_cnt;
+    if (dt < 0)
+        dt += scan_period_ticks;
+
+    scan_time_ticks = dt;
+
+    uint8_t keys = 0;
+    for (int i=0; i<16; i++)
+        keys |= scan_buf[scan_back][i];
+
+    tlm_write(TLM_SCAN, scan_buf[scan_back], sizeof(scan_buf[0]));
+
+    scan_end_time[scan_back] = get_us_time32();
+    scan_back ^= 1;
+    scan_seq++;
+    scan_woken = false;
+
+    if (keys) {
+        scan_empty_frames = 0;
+    }
+    else if (++scan_empty_frames >= SCAN_IDLE_FRAMES) {
+        scan_enter_idle();
+
+        // only the lines without EXTI need polling, so slow down
+        //
+        scan_start_timer(0, LPTIM_CFGR_PRESC, LPTIM_IER_ARRMIE, scan_idle_ticks);
+    }
+}
+
+
+void LPTIM1_IRQHandler(void)
+{
+    uint32_t isr = LPTIM1->ISR;
+    LPTIM1->ICR = isr & (LPTIM_ICR_CMPMCF | LPTIM_ICR_ARRMCF);
+
+    if ((isr & LPTIM_ISR_CMPM) && scan_row < 16) {
+        scan_buf[scan_back][scan_row++] = get_sense();
+
+        if (scan_row < 16)
+            scan_start_row(scan_row);
+        else
+            scan_end_frame();
+    }
+
+    if (isr & LPTIM_ISR_ARRM) {
+        // stretch or shrink the period that just started
+        //
+        int adjust = scan_adjust_ticks;
+        scan_adjust_ticks = 0;
+
+        if (!scan_idle && (adjust || scan_period_adjusted)) {
+            LPTIM1->ARR = scan_period_ticks - 1 + adjust;
+            scan_period_adjusted = (adjust != 0);
+        }
+
+        if (scan_idle) {
+            // poll the sense lines without EXTI
+            //
+            if (get_sense())
+                scan_wake();
+        }
+        else if (scan_row < 16) {
+            // previous frame took longer than SCAN_INTERVAL_US
+            //
+            if (!scan_woken)
+                kb_scan_stats.overruns++;
+        }
+        else {
+            scan_row = 0;
+            scan_start_row(0);
+        }
+    }
+}
+
+
+/**
+ * Align the scan frames to the USB frames.
+ *
+ * Called from the USB SOF interrupt.  A period correction only shows up
+ * at the SOF after next, so the loop gain is kept at 1/4 to avoid ringing.
+ */
+void kb_scan_sync(void)
+{
+    if (!scan_period_ticks || scan_suspended || scan_idle)
+        return;
+
+    int period = scan_period_ticks;
+    int err = (int)LPTIM1->CNT - scan_sof_lead_ticks;
+
+    if (err > period / 2)
+        err -= period;
+    else if (err < -period / 2)
+        err += period;
+
+    kb_scan_stats.sof_error = err / scan_ticks_per_us;
+    scan_adjust_ticks = clamp(err / 4, -period / 4, period / 4);
+}
+
+
+static void handle_sense_edge(void)
+{
+    uint32_t exti_pr = EXTI->PR & EXTI_SENSE_BITS;
+    EXTI->PR = exti_pr;     // clear our interrupts only
+
+    if (exti_pr && scan_idle)
+        scan_wake();
+}
+
+
+void EXTI0_1_IRQHandler(void)
+{
+    handle_sense_edge();
+}
+
+
+void EXTI4_15_IRQHandler(void)
+{
+    handle_sense_edge();
+}
+
+
+/**
+ * Handle a falling edge on PC2.
+ *
+ * Called from EXTI2_3_IRQHandler() in ps2_host.c, which
+ * shares its vector with the PS/2 clock.
+ */
+void kb_sense_irq(void)
+{
+    if (EXTI->PR & EXTI_SENSE_BITS)
+        handle_sense_edge();
+}
+
+
+/**
+ * Measure how long the sense lines take to recover with a drive line active.
+ *
+ * All sense lines are pulled low and released, and the time until the
+ * pull-ups alone have brought all of them back high is measured.  This
+ * is slower than the push/pull boost of discharge(), so it is an upper
+ * bound for the sense line settle time during a scan.
+ *
+ * \param  d  drive line
+ * \return  worst case of CAL_SAMPLES measurements in CPU cycles,
+ *          or -1 if a sense line did not recover (e.g. key pressed)
+ */
+static int measure_settle_time(int d)
+{
+    int max_dt = 0;
+
+    for (int n=0; n<CAL_SAMPLES; n++) {
         discharge();
-        set_drv(i);
-        delay_us(3);
-        matrix[i] = get_sense();
+        set_drv(d);
+
+        GPIOC->BRR = GPIOC_SENSE_BITS;
+        GPIOH->BRR = GPIOH_SENSE_BITS;
+        delay_us(SCAN_SETTLE_US);
+
+        __disable_irq();
+        uint32_t t0 = get_cycles();
+        GPIOC->BSRR = GPIOC_SENSE_BITS;
+        GPIOH->BSRR = GPIOH_SENSE_BITS;
+
+        int timeout = CAL_TIMEOUT;
+        while (get_sense() && --timeout);
+
+        int dt = get_cycles_since(t0);
+        __enable_irq();
+
+        if (!timeout)
+            return -1;
+
+        if (dt > max_dt)
+            max_dt = dt;
+    }
+
+    discharge();
+    return max_dt;
+}
+
+
+static void scan_calibrate(void)
+{
+    int cycles_per_us = SystemCoreClock / 1000000;
+    int total_ns = 0;
+    int min_ns = 0;
+    int max_ns = 0;
+
+    printf("kb: settle time [ns]:");
+
+    for (int d=0; d<16; d++) {
+        int ns;
+        int dt = measure_settle_time(d);
+
+        if (dt >= 0) {
+            ns = dt * 1000 / cycles_per_us * CAL_MARGIN;
+            if (ns < CAL_MIN_NS)
+                ns = CAL_MIN_NS;
+
+            printf(" %d", ns);
+        }
+        else {
+            ns = SCAN_SETTLE_US * 1000;
+            printf(" ?");
+        }
+
+        scan_settle_ticks[d] = (ns * scan_ticks_per_us + 999) / 1000;
+        total_ns += ns;
+        if (d == 0 || ns < min_ns)
+            min_ns = ns;
+        if (ns > max_ns)
+            max_ns = ns;
+    }
+
+    printf("\nkb: row settle time %d..%d ns (was %d ns)\n",
+        min_ns, max_ns, SCAN_SETTLE_US * 1000
+    );
+
+    printf("kb: total settle time %d us (was %d us)\n",
+        (total_ns + 999) / 1000, 16 * SCAN_SETTLE_US
+    );
+}
+
+
+/**
+ * (Re-)start LPTIM1 with a new clock source.
+ *
+ * \param  clksel  LPTIM1SEL bits in RCC->CCIPR
+ * \param  cfgr    LPTIM1->CFGR, e.g. the prescaler
+ * \param  ier     interrupts to enable
+ * \param  period  period in timer ticks
+ */
+static void scan_start_timer(uint32_t clksel, uint32_t cfgr, uint32_t ier, uint32_t period)
+{
+    LPTIM1->CR = 0;
+    RCC->CCIPR = (RCC->CCIPR & ~RCC_CCIPR_LPTIM1SEL) | clksel;
+
+    // IER and CFGR can only be written while disabled,
+    // CMP and ARR only while enabled.
+    //
+    LPTIM1->IER  = ier;
+    LPTIM1->CFGR = cfgr;
+    LPTIM1->CR   = LPTIM_CR_ENABLE;
+    LPTIM1->ARR  = period - 1;
+
+    // the write takes a few kernel clocks with the LSI
+    //
+    while (!(LPTIM1->ISR & LPTIM_ISR_ARROK));
+    LPTIM1->ICR = LPTIM_ICR_ARROKCF;
+
+    LPTIM1->CR |= LPTIM_CR_CNTSTRT;
+}
+
+
+static void scan_init(void)
+{
+    scan_ticks_per_us = HAL_RCC_GetPCLK1Freq() / 1000000;
+    scan_period_ticks = SCAN_INTERVAL_US * scan_ticks_per_us;
+    scan_sof_lead_ticks = SCAN_SOF_LEAD_US * scan_ticks_per_us;
+    scan_idle_ticks = SCAN_IDLE_POLL_US * scan_ticks_per_us / SCAN_IDLE_PRESC;
+
+    scan_calibrate();
+
+    // Falling edge on PC0, PC1, PC2, PC13 and PC15, masked until idle
+    //
+    SYSCFG->EXTICR[0] = (SYSCFG->EXTICR[0] & ~(SYSCFG_EXTICR1_EXTI0 | SYSCFG_EXTICR1_EXTI1 | SYSCFG_EXTICR1_EXTI2)) |
+                        SYSCFG_EXTICR1_EXTI0_PC | SYSCFG_EXTICR1_EXTI1_PC | SYSCFG_EXTICR1_EXTI2_PC;
+
+    SYSCFG->EXTICR[3] = (SYSCFG->EXTICR[3] & ~(SYSCFG_EXTICR4_EXTI13 | SYSCFG_EXTICR4_EXTI15)) |
+                        SYSCFG_EXTICR4_EXTI13_PC | SYSCFG_EXTICR4_EXTI15_PC;
+
+    EXTI->IMR  &= ~EXTI_SENSE_BITS;
+    EXTI->RTSR &= ~EXTI_SENSE_BITS;
+    EXTI->FTSR |=  EXTI_SENSE_BITS;
+
+    NVIC_SetPriority(EXTI0_1_IRQn, 15);
+    NVIC_SetPriority(EXTI2_3_IRQn, 15);
+    NVIC_SetPriority(EXTI4_15_IRQn, 15);
+    NVIC_EnableIRQ(EXTI0_1_IRQn);
+    NVIC_EnableIRQ(EXTI2_3_IRQn);
+    NVIC_EnableIRQ(EXTI4_15_IRQn);
+
+    RCC->APB1ENR |= RCC_APB1ENR_LPTIM1EN;
+
+    scan_start_timer(0, 0, LPTIM_IER_CMPMIE | LPTIM_IER_ARRMIE, scan_period_ticks);    // APB clock
+
+    NVIC_SetPriority(LPTIM1_IRQn, 15);
+    NVIC_EnableIRQ(LPTIM1_IRQn);
+
+    // report the resulting scan time
+    //
+    uint32_t t0 = HAL_GetTick();
+    while (!scan_seq && HAL_GetTick() - t0 < 10);
+
+    if (scan_seq)
+        printf("kb: scan time %d us\n", scan_time_ticks / scan_ticks_per_us);
+}
+
+
+/**
+ * Prepare the scanner for Stop mode.
+ *
+ * Turns off all LEDs, pulls the drive lines low and polls the sense
+ * lines from the LSI.  Can be called again to re-arm after a wake-up
+ * request was handled.
+ */
+void kb_suspend(void)
+{
+    __disable_irq();
+
+    if (!scan_suspended) {
+        scan_led_ccer[0] = TIM2->CCER;
+        scan_led_ccer[1] = TIM21->CCER;
+        scan_led_ccer[2] = TIM22->CCER;
+
+        TIM2->CCER  = 0;
+        TIM21->CCER = 0;
+        TIM22->CCER = 0;
+    }
+
+    scan_row = 16;
+    scan_enter_idle();
+
+    scan_suspended = true;
+    scan_wake_request = false;
+    scan_adjust_ticks = 0;
+    scan_period_adjusted = false;
+
+    scan_start_timer(
+        RCC_CCIPR_LPTIM1SEL_0, 0, LPTIM_IER_ARRMIE, // LSI clock
+        SCAN_LSI_HZ / 1000 * SCAN_SUSPEND_POLL_MS
+    );
+
+    __enable_irq();
+}
+
+
+/**
+ * Return to normal scanning after a suspend.
+ *
+ * If a key caused the wake-up, a frame is started right away.
+ */
+void kb_resume(void)
+{
+    if (!scan_suspended)
+        return;
+
+    __disable_irq();
+
+    scan_suspended = false;
+
+    if (scan_wake_request)
+        scan_exit_idle();
+    else
+        scan_start_timer(0, LPTIM_CFGR_PRESC, LPTIM_IER_ARRMIE, scan_idle_ticks);
+
+    scan_wake_request = false;
+
+    TIM2->CCER  = scan_led_ccer[0];
+    TIM21->CCER = scan_led_ccer[1];
+    TIM22->CCER = scan_led_ccer[2];
+
+    __enable_irq();
+}
+
+
+/**
+ * Check if a key was pressed while suspended.
+ */
+int kb_wake_requested(void)
+{
+    return scan_wake_request;
+}
+
+
+/**
+ * Check if the scanner is in idle mode.
+ */
+int kb_matrix_idle(void)
+{
+    return scan_idle;
+}
+
+
+/**
+ * Check if the scanner has completed a new frame
+ * since the last call to kb_scan_matrix().
+ */
+int kb_matrix_ready(void)
+{
+    return scan_seq != scan_seq_read;
+}
+
+
+/**
+ * Get the most recent frame from the background scanner.
+ *
+ * \param  matrix  where to store the 16 sense bytes
+ * \param  time    where to store the time the frame was completed [us]
+ * \return  number of ambiguous keys that were frozen
+ */
+int kb_scan_matrix(uint8_t *matrix, uint32_t *time)
+{
+    static uint8_t matrix_old[16];
+
+    // the scanner will not touch the front buffer for a whole
+    // frame period, but make sure we're not preempted anyway.
+    //
+    __disable_irq();
+    uint32_t seq = scan_seq;
+    memcpy(matrix, scan_buf[scan_back ^ 1], 16);
+    *time = scan_end_time[scan_back ^ 1];
+    __enable_irq();
+
+    if (seq - scan_seq_read > 1)
+        kb_scan_stats.dropped += seq - scan_seq_read - 1;
+
+    kb_scan_stats.frames = seq;
+    kb_scan_stats.scan_time = scan_time_ticks / scan_ticks_per_us;
+    scan_seq_read = seq;
+
+    if (scan_wake_pending) {
+        uint8_t keys = 0;
+        for (int i=0; i<16; i++)
+            keys |= matrix[i];
+
+        if (keys) {
+            // first key after idle
+            //
+            uint32_t dt = get_us_time32() - scan_wake_time;
+            scan_wake_pending = false;
+
+            kb_scan_stats.wake_latency = dt;
+            if (dt > kb_scan_stats.wake_latency_max)
+                kb_scan_stats.wake_latency_max = dt;
+        }
     }
 
     // ghost detection: ~10us
     //
+    // Without diodes, pressing three corners of a rectangle also
+    // shows the fourth one.  So if two rows have >= 2 keys in common,
+    // all of those are ambiguous and keep their previous state.
+    //
+    uint8_t ghost[16] = { 0 };
+
     for (int i=0; i<15; i++) {
-        if ((matrix[i] - 1) & matrix[i]) {
-            // if >= 2 keys are pressed .. (bit bashing trick)
-            //
-            for (int j = i + 1; j<16; j++) {
-                // .. check other rows for shared keys
+        if (!matrix[i])
+            continue;
+
+        for (int j = i + 1; j<16; j++) {
+            uint8_t common = matrix[i] & matrix[j];
+
+            if ((common - 1) & common) {
+                // >= 2 shared keys (bit bashing trick)
                 //
-                if (matrix[i] & matrix[j])
-                    return 0;
+                ghost[i] |= common;
+                ghost[j] |= common;
             }
         }
     }
 
-    return 1;
+    int n = 0;
+    for (int i=0; i<16; i++) {
+        if (ghost[i]) {
+            matrix[i] = (matrix[i] & ~ghost[i]) | (matrix_old[i] & ghost[i]);
+            n += __builtin_popcount(ghost[i]);
+        }
+        matrix_old[i] = matrix[i];
+    }
+
+    kb_scan_stats.ghost_keys = n;
+    if (n) {
+        kb_scan_stats.ghost_frames++;
+        kb_scan_stats.ghost_keys_total += n;
+    }
+
+    return n;
 }
 
 
@@ -307,4 +925,6 @@ void kb_init(void)
     HAL_GPIO_Init(GPIOA, &gpio_init);
 
     kb_set_brightness(128);
+
+    scan_init();
 }
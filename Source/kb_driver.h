@@ -3,7 +3,34 @@
 #include <stdint.h>
 #include "keyboard.h"
 
-int  kb_scan_matrix(uint8_t *matrix);
+struct kb_scan_stats {
+    uint32_t frames;        // frames completed by the scanner
+    uint32_t dropped;       // frames not picked up by kb_scan_matrix()
+    uint32_t overruns;      // frames longer than the scan interval
+    uint32_t scan_time;     // us from first to last drive line
+
+    uint32_t ghost_keys;        // ambiguous keys in the last frame
+    uint32_t ghost_keys_total;  // .. summed over all frames
+    uint32_t ghost_frames;      // frames with ambiguous keys
+
+    uint32_t wakeups;           // idle mode exits
+    uint32_t wake_latency;      // us from wake-up to first key, last
+    uint32_t wake_latency_max;  // .. and worst case
+
+    int32_t  sof_error;         // us from planned to actual frame phase at SOF
+};
+
+extern struct kb_scan_stats kb_scan_stats;
+
+void kb_suspend(void);
+void kb_resume(void);
+int  kb_wake_requested(void);
+
+int  kb_matrix_idle(void);
+int  kb_matrix_ready(void);
+int  kb_scan_matrix(uint8_t *matrix, uint32_t *time);
+void kb_scan_sync(void);
+void kb_sense_irq(void);
 
 int  kb_get_fn_key(void);
 int  kb_get_power_key(void);
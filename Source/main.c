@@ -16,6 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "hid_debug.h"
+#include "cdc_console.h"
+#include "debounce.h"
 #include "kb_driver.h"
 #include "keyboard.h"
 #include "ps2_host.h"
@@ -25,6 +27,11 @@
 #include "usbd_desc.h"
 #include "usbd_hid.h"
 #include "stm32l0xx.h"
+#include <stdbool.h>
+
+
+#define MOUSE_SOF_LEAD_US   300     // send mouse reports this long before SOF
+#define RESUME_TIMEOUT_US   100000  // give up waiting for the wake-up key report
 
 
 static IWDG_HandleTypeDef hiwdg;
@@ -43,6 +50,7 @@ void SysTick_Handler(void)
 {
     HAL_IncTick();
     HAL_SYSTICK_IRQHandler();
+    ps2_tick();
 }
 
 
@@ -127,29 +135,215 @@ void assert_failed(uint8_t* file, uint32_t line)
 }
 
 
-void handle_out_requests(void)
+/**
+ * Check if the next USB frame is about to start.
+ *
+ * Also returns true if there are no SOFs, e.g. while suspended.
+ *
+ * \param  lead_us  time before the next SOF
+ */
+static int usb_frame_due(uint32_t lead_us)
+{
+    return get_us_time32() - usb_sof_time >= USB_FRAME_US - lead_us;
+}
+
+
+static int kb_boot_protocol(void)
 {
     USBD_HID_HandleTypeDef *hhid = hUsbDeviceFS.pClassData;
 
-    if (!hhid->ep0_out_req_ready)
+    return hhid && hhid->Protocol[HID_KEYBOARD_INTERFACE] == HID_PROTOCOL_BOOT;
+}
+
+
+static struct kb_out_report kb_leds;
+
+
+// Remote wakeup in progress, see usb_suspend()
+//
+static bool     resume_pending;
+static uint32_t resume_time;
+static bool     tp_powered_down;
+
+
+/**
+ * Sleep in Stop mode while the USB bus is suspended.
+ *
+ * The TrackPoint is powered down, and the scanner polls the matrix
+ * from the LSI.  A key press signals remote wakeup, if the host has
+ * enabled it.  Returns after the bus has been resumed.
+ */
+static void usb_suspend(void)
+{
+    tp_power_down();
+    tp_powered_down = true;
+
+    kb_suspend();
+
+    // Wake up on HSI16, with VREFINT off in Stop mode
+    //
+    __HAL_RCC_WAKEUPSTOP_CLK_CONFIG(RCC_StopWakeUpClock_HSI);
+    HAL_PWREx_EnableUltraLowPower();
+    HAL_PWREx_EnableFastWakeUp();
+
+    EXTI->IMR |= EXTI_IMR_IM18 | EXTI_IMR_IM29;     // USB and LPTIM1 wake-up
+
+    while (hUsbDeviceFS.dev_state == USBD_STATE_SUSPENDED) {
+        // Pending interrupts end WFI even while masked.  They
+        // must not run before the clocks have been restored.
+        //
+        __disable_irq();
+
+        if (hUsbDeviceFS.dev_state == USBD_STATE_SUSPENDED && !kb_wake_requested()) {
+            HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+            SystemClock_Config();
+            usb_suspend_stats.stop_wakeups++;
+        }
+
+        __enable_irq();
+
+        if (kb_wake_requested()) {
+            resume_time = get_us_time32();
+
+            if (usb_remote_wakeup()) {
+                resume_pending = true;
+                break;
+            }
+
+            // not allowed to wake up the host, go back to sleep
+            //
+            kb_suspend();
+        }
+    }
+
+    kb_resume();
+}
+
+
+/**
+ * Record the resume latency when the first keyboard
+ * report after a remote wakeup has been sent.
+ */
+static void resume_report_sent(void)
+{
+    if (!resume_pending)
         return;
 
-    uint8_t report_type = hhid->ep0_out_req.wValue >> 8;
-    uint8_t report_id = hhid->ep0_out_req.wValue & 0xff;
+    uint32_t dt = get_us_time32() - resume_time;
+
+    usb_suspend_stats.resume_latency = dt;
+    if (dt > usb_suspend_stats.resume_latency_max)
+        usb_suspend_stats.resume_latency_max = dt;
+
+    resume_pending = false;
+}
+
+
+#define REPORT(r)   ( memcpy(buf, &(r), MIN(sizeof(r), size)), MIN(sizeof(r), size) )
+
+/**
+ * Get the current state of a report for HID_REQ_GET_REPORT.
+ *
+ * Keyboard reports of the interface that is not in use are
+ * returned empty, mouse reports without motion.
+ *
+ * \param  iface   interface number
+ * \param  type    HID_REPORT_INPUT, _OUTPUT or _FEATURE
+ * \param  id      report ID
+ * \param  buf     where to store the report
+ * \param  size    size of buf
+ * \return length of the report, or 0 if there is no such report
+ */
+int hid_get_report(int iface, int type, int id, uint8_t *buf, int size)
+{
+    switch (iface) {
+    case HID_KEYBOARD_INTERFACE:
+        if (type == HID_REPORT_INPUT && id == 0) {
+            static const struct kb_in_report empty;
+            return kb_boot_protocol() ? REPORT(kb_in_report) : REPORT(empty);
+        }
+        if (type == HID_REPORT_OUTPUT && id == 0)
+            return REPORT(kb_leds);
+        break;
 
-    switch (hhid->ep0_out_req.wIndex) {
-    case 0:
-        if (report_type == 2 && report_id == 0)
-            kb_set_leds((struct kb_out_report *)hhid->ep0_out_buf);
+    case HID_MOUSE_INTERFACE:
+        if (type == HID_REPORT_INPUT && id == 0) {
+            struct tp_mouse_report mr = { .buttons = tp_mouse_report.buttons };
+            return REPORT(mr);
+        }
         break;
 
-    case 2:
-        if (report_type == 3 && report_id == 0x80)
-            enter_bootloader();
+    case HID_EXTRA_INTERFACE:
+        if (type == HID_REPORT_INPUT && id == 1)
+            return REPORT(kb_sysctrl_report);
+
+        if (type == HID_REPORT_INPUT && id == 2)
+            return REPORT(kb_consumer_report);
+
+        if (type == HID_REPORT_FEATURE && id == 0x80) {
+            uint8_t detach[2] = { 0x80, 0 };
+            return REPORT(detach);
+        }
+
+        if (type == HID_REPORT_FEATURE && id == 0x81) {
+            uint8_t config[4] = {
+                0x81, debounce_get_mode(), debounce_get_samples(), debounce_get_holdoff()
+            };
+            return REPORT(config);
+        }
+        break;
+
+#if !USB_CDC_CONSOLE
+    case HID_DEBUG_INTERFACE:
+        if (type == HID_REPORT_INPUT && id == 0) {
+            uint8_t debug[HID_DEBUG_EPIN_SIZE - 1] = { 0 };
+            return REPORT(debug);
+        }
+        break;
+#endif
+
+    case HID_NKRO_INTERFACE:
+        if (type == HID_REPORT_INPUT && id == 0) {
+            static const struct kb_nkro_report empty;
+            return kb_boot_protocol() ? REPORT(empty) : REPORT(kb_nkro_report);
+        }
+        if (type == HID_REPORT_OUTPUT && id == 0)
+            return REPORT(kb_leds);
         break;
     }
 
-    hhid->ep0_out_req_ready = 0;
+    return 0;
+}
+
+
+void handle_out_requests(void)
+{
+    struct hid_out_report r;
+
+    while (USBD_HID_GetOutReport(&hUsbDeviceFS, &r)) {
+        switch (r.iface) {
+        case HID_KEYBOARD_INTERFACE:
+        case HID_NKRO_INTERFACE:
+            if (r.type == HID_REPORT_OUTPUT && r.id == 0 && r.len >= sizeof(kb_leds)) {
+                memcpy(&kb_leds, r.data, sizeof(kb_leds));
+                kb_set_leds(&kb_leds);
+            }
+            break;
+
+        case HID_EXTRA_INTERFACE:
+            if (r.id == 0x80)
+                enter_bootloader();
+
+            if (r.id == 0x81 && r.len >= 4) {
+                debounce_configure(r.data[1], r.data[2], r.data[3]);
+
+                printf("debounce: mode %d, samples %d, hold-off %d\n",
+                    debounce_get_mode(), debounce_get_samples(), debounce_get_holdoff()
+                );
+            }
+            break;
+        }
+    }
 }
 
 
@@ -184,45 +378,87 @@ int main(void)
     tp_init();
 
     static struct tp_mouse_report     mr_old;
-    static struct kb_in_report        kr_old;
-    static struct kb_sysctrl_report   sr_old;
-    static struct kb_consumer_report  cr_old;
 
     for (;;) {
+        if (hUsbDeviceFS.dev_state == USBD_STATE_SUSPENDED)
+            usb_suspend();
+
+        if (resume_pending && get_us_time32() - resume_time > RESUME_TIMEOUT_US)
+            resume_pending = false;
+
+        // The self-test runs in the background from tp_update()
+        //
+        if (tp_powered_down) {
+            tp_power_up();
+            tp_powered_down = false;
+        }
+
         kb_update();
         tp_update();
 
-        // Send keyboard reports on state change only
+        // Apply queued key events until one of them changes a report.
+        // It must be sent before the next event is applied, so every
+        // transition reaches the host even if the endpoint is busy.
         //
-        if (memcmp(&kb_in_report, &kr_old, sizeof(kb_in_report))) {
-            if (USBD_HID_SendReport(&hUsbDeviceFS, HID_KEYBOARD_EPIN_ADDR, &kb_in_report, sizeof(kb_in_report)) == USBD_OK)
-                kr_old = kb_in_report;
+        while (!kb_dirty && !USBD_HID_QueuePending(&hUsbDeviceFS, HID_EXTRA_EPIN_ADDR) && kb_process_event());
+
+        // Send changed keyboard reports
+        //
+        if (kb_dirty & KB_DIRTY_KEYBOARD) {
+            uint8_t ret;
+
+            // Use the NKRO interface unless the host asked for boot protocol
+            //
+            if (kb_boot_protocol())
+                ret = USBD_HID_SendReport(&hUsbDeviceFS, HID_KEYBOARD_EPIN_ADDR, &kb_in_report, sizeof(kb_in_report));
+            else
+                ret = USBD_HID_SendReport(&hUsbDeviceFS, HID_NKRO_EPIN_ADDR, &kb_nkro_report, sizeof(kb_nkro_report));
+
+            if (ret == USBD_OK) {
+                kb_dirty &= ~KB_DIRTY_KEYBOARD;
+                resume_report_sent();
+            }
         }
 
-        if (memcmp(&kb_sysctrl_report, &sr_old, sizeof(kb_sysctrl_report))) {
-            if (USBD_HID_SendReport(&hUsbDeviceFS, HID_EXTRA_EPIN_ADDR, &kb_sysctrl_report, sizeof(kb_sysctrl_report)) == USBD_OK)
-                sr_old = kb_sysctrl_report;
+        if (kb_dirty & KB_DIRTY_SYSCTRL) {
+            if (USBD_HID_QueueReport(&hUsbDeviceFS, HID_EXTRA_EPIN_ADDR, &kb_sysctrl_report, sizeof(kb_sysctrl_report)) == USBD_OK)
+                kb_dirty &= ~KB_DIRTY_SYSCTRL;
         }
 
-        if (memcmp(&kb_consumer_report, &cr_old, sizeof(kb_consumer_report))) {
-            if (USBD_HID_SendReport(&hUsbDeviceFS, HID_EXTRA_EPIN_ADDR, &kb_consumer_report, sizeof(kb_consumer_report)) == USBD_OK)
-                cr_old = kb_consumer_report;
+        if (kb_dirty & KB_DIRTY_CONSUMER) {
+            if (USBD_HID_QueueReport(&hUsbDeviceFS, HID_EXTRA_EPIN_ADDR, &kb_consumer_report, sizeof(kb_consumer_report)) == USBD_OK)
+                kb_dirty &= ~KB_DIRTY_CONSUMER;
         }
 
-        // Send mouse reports while moving and on button change
+        // Send mouse reports while moving and on button change.
+        // Wait until just before the next frame to collect as much
+        // motion as possible in each report.
         //
-        if (tp_mouse_report.dx      || tp_mouse_report.dy   ||
+        bool mouse_pending =
+            tp_mouse_report.dx      || tp_mouse_report.dy   ||
             tp_mouse_report.dwheel  || tp_mouse_report.dpan ||
-            tp_mouse_report.buttons != mr_old.buttons)
-        {
+            tp_mouse_report.buttons != mr_old.buttons;
+
+        if (mouse_pending && usb_frame_due(MOUSE_SOF_LEAD_US)) {
             if (USBD_HID_SendReport(&hUsbDeviceFS, HID_MOUSE_EPIN_ADDR, &tp_mouse_report, sizeof(tp_mouse_report)) == USBD_OK) {
                 tp_clear_mouse_report();
                 mr_old = tp_mouse_report;
             }
         }
 
+#if USB_CDC_CONSOLE
+        cdc_console_update();
+#else
         hid_debug_flush();
+#endif
 
         handle_out_requests();
+
+        // Nothing to scan, sleep until the next interrupt.
+        // No interrupt marks the start of the mouse report window,
+        // so keep polling while a report is waiting for it.
+        //
+        if (kb_matrix_idle() && !mouse_pending)
+            __WFI();
     }
 }
@@ -19,63 +19,345 @@
 /*
      see http://www.computer-engineering.org/ps2protocol/
      see https://github.com/tmk/tmk_keyboard
-     TODO: receive/send buffer
-     TODO: inhibit on overflow
-     TODO: handle time outs
 */
 
 #include "ps2_host.h"
+#include "kb_driver.h"
+#include "telemetry.h"
 #include "ustime.h"
+#include "ringbuf.h"
 #include "stm32l0xx_hal.h"
 #include <stdbool.h>
 
 #define PIN_CLK     GPIO_PIN_3
 #define PIN_DATA    GPIO_PIN_4
 
+// Host to device timing [us]
+//
+#define PS2_RTS_US          100     // min. clock inhibit for request-to-send
+#define PS2_TX_TIMEOUT_US   20000   // max. time for the device to clock out a byte
+
+// Device to host timing [us]
+//
+#define PS2_BIT_TIMEOUT_US  250     // max. gap between clock edges within a frame
+
+// SPI capture timing [us]
+//
+#define PS2_CAPTURE_TIMEOUT_US  2000    // max. gap between bytes of a packet
+
+// Inhibit the clock when less than one mouse packet fits
+// into the receive buffer.  The device holds back further
+// bytes until ps2_read() has made room.
+//
+#define PS2_RX_RESERVE      3
+
 // PS/2 Receive state
 //
 static volatile int rx_frame;
 static volatile int rx_frame_pos;
+static volatile int rx_inhibited;
+static volatile int rx_resync;      // skip edges until the clock pauses
+static uint32_t     rx_edge_time;
 
-/*static*/ volatile int rx_buf = -1;
+static struct ringbuf rx_buf = RINGBUF(PS2_RX_BUFFER_SIZE);
 
-static volatile int rx_bytes;
-static volatile int rx_errors;
+// Arrival time of each byte in rx_buf, indexed by byte count
+//
+static uint32_t     rx_time[PS2_RX_BUFFER_SIZE];
+static uint32_t     rx_put_count;
+static uint32_t     rx_get_count;
+
+struct ps2_stats ps2_stats;
 
 // PS/2 Transmit state
 //
+enum {
+    TX_IDLE,
+    TX_REQUEST,     // clock inhibited for request-to-send
+    TX_FRAME        // shifting out bits on device clock edges
+};
+
+static volatile int tx_state;
 static volatile int tx_frame;
 static volatile int tx_frame_pos;
+static uint32_t     tx_time;
+
+static uint8_t      tx_data;
+static volatile int tx_status;
+
+#if PS2_CAPTURE
+// SPI capture state
+//
+// SPI1 is clocked by CLK (PB3 = SPI1_SCK) and samples DATA
+// (PB4 = SPI1_MISO, the data line of a 1-line bidirectional
+// slave) on falling edges.  It shifts in 8 bits per interrupt.
+// A packet of n frames has 11*n bits.  The remaining bits that
+// don't fill a whole SPI byte are taken from the EXTI interrupt.
+// Capture is only started while the bus is idle, so the first
+// bit is always the start bit of a packet.
+//
+enum {
+    CAP_OFF,        // bits are received by handle_clk_edge()
+    CAP_SPI,        // SPI shifts in whole bytes
+    CAP_TAIL        // remaining bits of the packet from EXTI
+};
+
+static volatile int cap_bytes;      // frames per packet, 0 = disabled
+static uint32_t     cap_idle_us;    // bus idle time before capture starts
+static volatile int cap_state;
+static uint64_t     cap_bits;
+static volatile int cap_pos;
+static uint32_t     cap_time;
+#endif
+
+
+enum {
+    FRAME_OK,
+    FRAME_ERROR,    // bad start or stop bit
+    PARITY_ERROR
+};
+
+
+#if PS2_CAPTURE
+
+static void cap_start(void)
+{
+    // Reset SPI1 to clear a partially shifted byte
+    //
+    RCC->APB2RSTR |=  RCC_APB2RSTR_SPI1RST;
+    RCC->APB2RSTR &= ~RCC_APB2RSTR_SPI1RST;
+
+    // Slave, 1-line receive, LSB first, 8 bit.
+    // CPOL=1, CPHA=0: sample on the falling edge
+    //
+    SPI1->CR1 = SPI_CR1_BIDIMODE | SPI_CR1_LSBFIRST | SPI_CR1_SSM | SPI_CR1_CPOL;
+    SPI1->CR2 = SPI_CR2_RXNEIE;
+    SPI1->CR1 |= SPI_CR1_SPE;
+
+    // CLK and DATA to AF0 (SPI1_SCK, SPI1_MISO)
+    //
+    GPIOB->MODER = (GPIOB->MODER & ~(GPIO_MODER_MODE3   | GPIO_MODER_MODE4))
+                                 |   GPIO_MODER_MODE3_1 | GPIO_MODER_MODE4_1;
+
+    EXTI->IMR &= ~PIN_CLK;
+
+    cap_bits  = 0;
+    cap_pos   = 0;
+    cap_state = CAP_SPI;
+
+    rx_frame = 0;
+    rx_frame_pos = 0;
+    rx_resync = false;
+}
+
+
+/**
+ * Switch back to receiving with one interrupt per bit.
+ */
+static void cap_stop(void)
+{
+    SPI1->CR1 &= ~SPI_CR1_SPE;
+
+    // CLK and DATA back to open-drain outputs
+    //
+    GPIOB->MODER = (GPIOB->MODER & ~(GPIO_MODER_MODE3   | GPIO_MODER_MODE4))
+                                 |   GPIO_MODER_MODE3_0 | GPIO_MODER_MODE4_0;
+
+    EXTI->PR   = PIN_CLK;
+    EXTI->IMR |= PIN_CLK;
+
+    cap_state = CAP_OFF;
+}
+
+
+static int handle_frame(int frame);
+
+
+/**
+ * Check and store all frames of a captured packet.
+ */
+static void cap_finish(void)
+{
+    bool ok = true;
+
+    for (int i=0; i<cap_bytes && ok; i++)
+        ok = handle_frame((cap_bits >> (11 * i)) & 0x7FF) != FRAME_ERROR;
+
+    if (cap_state == CAP_OFF) {
+        // stopped to inhibit the clock
+        //
+        return;
+    }
+
+    if (ok) {
+        cap_start();
+    }
+    else {
+        // out of step, receive bit by bit until the bus is idle
+        //
+        ps2_stats.capture_errors++;
+
+        cap_stop();
+        rx_resync = true;
+        rx_edge_time = get_us_time32();
+    }
+}
+
+
+static void handle_cap_edge(int data)
+{
+    cap_bits |= (uint64_t)!!data << cap_pos++;
+    cap_time  = get_us_time32();
+
+    if (cap_pos >= 11 * cap_bytes)
+        cap_finish();
+}
+
+
+static void handle_cap_timer(void)
+{
+    uint32_t t = get_us_time32();
+
+    if (cap_state == CAP_OFF) {
+        if (cap_bytes && !rx_inhibited && t - rx_edge_time > cap_idle_us)
+            cap_start();
+    }
+    else if (cap_pos > 0 && t - cap_time > PS2_CAPTURE_TIMEOUT_US) {
+        // Packet was cut short
+        //
+        ps2_stats.timeouts++;
 
-static volatile int tx_buf = -1;
+        cap_stop();
+        rx_resync = true;
+        rx_edge_time = t;
+    }
+}
 
 
-volatile bool foo;
+void SPI1_IRQHandler(void)
+{
+    uint32_t t0 = get_cycles();
+    int data = SPI1->DR;
+
+    if (cap_state == CAP_SPI) {
+        cap_bits |= (uint64_t)data << cap_pos;
+        cap_pos  += 8;
+        cap_time  = get_us_time32();
+
+        int remaining = 11 * cap_bytes - cap_pos;
+
+        if (remaining == 0) {
+            cap_finish();
+        }
+        else if (remaining < 8) {
+            // Fetch the last bits from the clock interrupt
+            //
+            SPI1->CR1 &= ~SPI_CR1_SPE;
 
+            EXTI->PR   = PIN_CLK;
+            EXTI->IMR |= PIN_CLK;
 
-static bool check_frame(int frame)
+            cap_state = CAP_TAIL;
+        }
+    }
+
+    ps2_stats.irqs++;
+    ps2_stats.irq_cycles += get_cycles_since(t0);
+}
+
+#endif
+
+
+static int check_frame(int frame)
 {
     if (frame & (1<<0))         // start bit
-        return false;
+        return FRAME_ERROR;
 
     if (!(frame & (1<<10)))     // stop bit
-        return false;
+        return FRAME_ERROR;
 
     int parity = 0;             // parity check
     for (int b=1; b<=9; b++)
         parity ^= !!(frame & (1 << b));
 
     if (parity != 1)
-        return false;
+        return PARITY_ERROR;
+
+    return FRAME_OK;
+}
+
+
+/**
+ * Check a received frame and store its data byte.
+ *
+ * \param  frame   start + 8 bits + parity + stop
+ * \return FRAME_OK, FRAME_ERROR or PARITY_ERROR
+ */
+static int handle_frame(int frame)
+{
+    int err = check_frame(frame);
+
+    tlm_write(TLM_PS2_RX, &(struct tlm_ps2) {
+        .frame = frame,
+        .data  = (frame >> 1) & 255,
+        .error = err != FRAME_OK
+    }, sizeof(struct tlm_ps2));
+
+    if (err == FRAME_OK) {
+        rx_time[rx_put_count % PS2_RX_BUFFER_SIZE] = get_us_time32();
+
+        if (rb_putchar(&rx_buf, (frame >> 1) & 255) >= 0) {
+            rx_put_count++;
+            ps2_stats.rx_bytes++;
+        }
+        else {
+            ps2_stats.overflows++;
+        }
+
+        if (rb_bytes_free(&rx_buf) < PS2_RX_RESERVE) {
+#if PS2_CAPTURE
+            if (cap_state != CAP_OFF)
+                cap_stop();
+#endif
+            GPIOB->BRR = PIN_CLK;   // Inhibit clock
+            rx_inhibited = true;
+        }
+    }
+    else if (err == PARITY_ERROR) {
+        ps2_stats.parity_errors++;
+    }
+    else {
+        ps2_stats.framing_errors++;
+    }
 
-    return true;
+    return err;
 }
 
 
 static void handle_clk_edge(int data)
 {
+    uint32_t t  = get_us_time32();
+    uint32_t dt = t - rx_edge_time;
+
+    rx_edge_time = t;
+
+    // The clock never pauses within a frame, so the first
+    // edge after a pause always starts a new one.
+    //
+    if (dt > PS2_BIT_TIMEOUT_US) {
+        if (rx_frame_pos > 0 && !rx_resync)
+            ps2_stats.timeouts++;
+
+        rx_frame = 0;
+        rx_frame_pos = 0;
+        rx_resync = false;
+    }
+    else if (rx_resync) {
+        return;
+    }
+
     if (rx_frame_pos == 0 && data != 0) {
-        // invalid start bit.. try to resync
+        // invalid start bit, e.g. our own edge when inhibiting
         //
         return;
     }
@@ -87,14 +369,10 @@ static void handle_clk_edge(int data)
     if (rx_frame_pos >= 11) {
         // start + 8 bits + parity + stop received
         //
-        if (check_frame(rx_frame)) {
-            rx_buf = (rx_frame >> 1) & 255;
-
-            GPIOB->BRR = PIN_CLK;   // Inhibit clock
-            rx_bytes++;
-        }
-        else {
-            rx_errors++;
+        if (handle_frame(rx_frame) == FRAME_ERROR) {
+            // we are probably out of step with the device
+            //
+            rx_resync = true;
         }
 
         rx_frame = 0;
@@ -103,80 +381,357 @@ static void handle_clk_edge(int data)
 }
 
 
+/**
+ * Inhibit the clock to request sending tx_data.
+ * The frame starts in handle_tx_timer().
+ */
+static void tx_request(void)
+{
+    uint8_t data = tx_data;
+
+    int parity = 0;
+    for (int b=0; b<=7; b++)
+        parity ^= !!(data & (1 << b));
+
+    // start + data + parity + stop
+    //
+    tx_frame = (data << 1) | (!parity << 9) | (1 << 10);
+    tx_frame_pos = 1;
+
+    GPIOB->BRR = PIN_CLK;   // Inhibit clock
+
+    // a partially received frame is aborted by the device
+    //
+    rx_frame = 0;
+    rx_frame_pos = 0;
+    rx_resync = false;
+
+    tx_time  = get_us_time32();
+    tx_state = TX_REQUEST;
+}
+
+
+static void tx_finish(int status)
+{
+    GPIOB->BSRR = PIN_DATA;     // release data
+
+    // keep the clock inhibited until ps2_read() has made room
+    //
+    if (rx_inhibited)
+        GPIOB->BRR = PIN_CLK;
+    else
+        GPIOB->BSRR = PIN_CLK;
+
+    if (status != PS2_TX_DONE)
+        ps2_stats.tx_errors++;
+
+    tx_status = status;
+    tx_state  = TX_IDLE;
+}
+
+
+static void handle_tx_edge(void)
+{
+    if (tx_state != TX_FRAME) {
+        // our own edge from inhibiting the clock
+        //
+        return;
+    }
+
+    if (tx_frame_pos <= 10) {
+        // Set up data, parity and stop bit while the clock
+        // is low.  The device samples them on the rising edge.
+        //
+        if (tx_frame & (1 << tx_frame_pos))
+            GPIOB->BSRR = PIN_DATA;
+        else
+            GPIOB->BRR = PIN_DATA;
+
+        tx_frame_pos++;
+        return;
+    }
+
+    // 11th clock: the device pulls data low to acknowledge
+    //
+    if (GPIOB->IDR & PIN_DATA) {
+        tx_finish(PS2_TX_NACK);
+        return;
+    }
+
+    ps2_stats.tx_bytes++;
+    tx_finish(PS2_TX_DONE);
+}
+
+
+static void handle_tx_timer(void)
+{
+    uint32_t dt = get_us_time32() - tx_time;
+
+    if (tx_state == TX_REQUEST && dt >= PS2_RTS_US) {
+        // Send start bit and let the device generate the clock
+        //
+        GPIOB->BRR  = PIN_DATA;
+        GPIOB->BSRR = PIN_CLK;
+
+        tx_time  = get_us_time32();
+        tx_state = TX_FRAME;
+    }
+    else if (tx_state == TX_FRAME && dt > PS2_TX_TIMEOUT_US) {
+        tx_finish(PS2_TX_TIMEOUT);
+    }
+}
+
+
 void EXTI2_3_IRQHandler(void)
 {
-    uint32_t exti_pr = EXTI->PR;
+    uint32_t t0 = get_cycles();
+    uint32_t exti_pr = EXTI->PR & EXTI_PR_PR3;
 
     if (exti_pr & EXTI_PR_PR3) {
-        if (!foo)
+        if (tx_state != TX_IDLE)
+            handle_tx_edge();
+#if PS2_CAPTURE
+        else if (cap_state == CAP_TAIL)
+            handle_cap_edge(GPIOB->IDR & PIN_DATA);
+        else if (cap_state == CAP_SPI)
+            ;   // edge before capture started
+#endif
+        else
             handle_clk_edge(GPIOB->IDR & PIN_DATA);
     }
+    else if (tx_state != TX_IDLE) {
+        // triggered by ps2_tick()
+        //
+        handle_tx_timer();
+    }
+#if PS2_CAPTURE
+    else {
+        handle_cap_timer();
+    }
+#endif
 
-    EXTI->PR = exti_pr;     // clear interrupts
+    EXTI->PR = exti_pr;     // clear our interrupts only
     EXTI->PR;               // dummy read to avoid glitches
+
+    ps2_stats.irqs++;
+    ps2_stats.irq_cycles += get_cycles_since(t0);
+
+    // EXTI2 is a keyboard sense line
+    //
+    kb_sense_irq();
 }
 
 
-static void ps2_send_byte(uint8_t data)
+/**
+ * Advance the transmit state machine and start or time out
+ * SPI capture.
+ *
+ * Called from the 1ms SysTick interrupt.  The timing is done in
+ * the EXTI handler, so the PS/2 state is only ever changed from
+ * interrupts of the same priority.
+ */
+void ps2_tick(void)
 {
-    int parity = 0;
-    for (int b=0; b<=7; b++)
-        parity ^= !!(data & (1 << b));
+    if (tx_state != TX_IDLE) {
+        NVIC_SetPendingIRQ(EXTI2_3_IRQn);
+    }
+#if PS2_CAPTURE
+    else if (cap_bytes && !rx_inhibited) {
+        uint32_t t = get_us_time32();
 
-    // start + data + parity + stop
-    //
-    int frame = (data << 1) | (!parity << 9) | (1 << 10);
+        if (cap_state == CAP_OFF ? t - rx_edge_time > cap_idle_us
+                                 : cap_pos > 0 && t - cap_time > PS2_CAPTURE_TIMEOUT_US)
+            NVIC_SetPendingIRQ(EXTI2_3_IRQn);
+    }
+#endif
+}
 
-    foo = 1;
 
-    GPIOB->BSRR = (PIN_CLK << 16);  // clk lo
-    delay_us(100);
+/**
+ * Receive packets of n frames with SPI1, instead of one
+ * interrupt per bit.
+ *
+ * Capture starts when the bus has been idle for idle_us, so it
+ * is aligned to the first frame of a packet.  This must be longer
+ * than the largest gap between the bytes of a packet.  Any
+ * ps2_write() switches back to bit-wise receive, since the
+ * response has a different length.
+ *
+ * \param  n        frames per packet, 1..5, 0 to disable
+ * \param  idle_us  bus idle time before capture starts
+ */
+void ps2_capture(int n, uint32_t idle_us)
+{
+#if PS2_CAPTURE
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
 
-    for (int i=0; i<11; i++) {
-        if (frame & (1<<i))
-            GPIOB->BSRR = PIN_DATA;
-        else
-            GPIOB->BRR = PIN_DATA;
+    cap_bytes = (n >= 1 && n <= 5) ? n : 0;
+    cap_idle_us = idle_us;
+
+    if (!cap_bytes && cap_state != CAP_OFF)
+        cap_stop();
+
+    __set_PRIMASK(primask);
+#endif
+}
+
+
+/**
+ * Get number of received bytes that can be read
+ * without waiting.
+ */
+size_t ps2_rx_available(void)
+{
+    return rb_bytes_used(&rx_buf);
+}
 
-        delay_us(15);
 
-        GPIOB->BSRR = PIN_CLK;  // clk hi
+/**
+ * Resume receiving once there is room in the buffer again.
+ */
+static void rx_resume(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
 
-        while (!(GPIOB->IDR & PIN_CLK));
-        while (GPIOB->IDR & PIN_CLK);
+    if (rx_inhibited && rb_bytes_free(&rx_buf) >= PS2_RX_RESERVE) {
+        rx_inhibited = false;
+        if (tx_state == TX_IDLE)
+            GPIOB->BSRR = PIN_CLK;   // Idle
     }
 
-    foo = 0;
+    __set_PRIMASK(primask);
 }
 
 
-ssize_t ps2_read(void *buf, size_t n)
+/**
+ * Get a received byte without waiting.
+ *
+ * \param  time  where to store the arrival time [us], or NULL
+ * \return the byte, or -1 if there is none
+ */
+int ps2_getchar(uint32_t *time)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    int c = rb_getchar(&rx_buf);
+    if (c >= 0) {
+        if (time)
+            *time = rx_time[rx_get_count % PS2_RX_BUFFER_SIZE];
+
+        rx_get_count++;
+    }
+
+    __set_PRIMASK(primask);
+
+    if (c >= 0 && rx_inhibited)
+        rx_resume();
+
+    return c;
+}
+
+
+/**
+ * Read bytes from the device, waiting at most
+ * timeout_us for each one.
+ *
+ * \param  buf         where to store the bytes
+ * \param  n           number of bytes
+ * \param  timeout_us  max. wait per byte
+ * \return number of bytes read, less than n on timeout
+ */
+ssize_t ps2_read_timeout(void *buf, size_t n, uint32_t timeout_us)
 {
     uint8_t *d = buf;
 
     for (int i=0; i<n; i++) {
-        while (rx_buf == -1);
-        *d++ = rx_buf;
+        uint32_t t0 = get_us_time32();
+        int c;
+
+        while ((c = ps2_getchar(NULL)) < 0) {
+            if (get_us_time32() - t0 > timeout_us) {
+                ps2_stats.read_timeouts++;
+                return i;
+            }
+        }
 
-        rx_buf = -1;
-        GPIOB->BSRR = PIN_CLK;   // Idle
+        *d++ = c;
     }
 
     return n;
 }
 
 
+/**
+ * Read bytes from the device, e.g. the response to a command.
+ *
+ * \return number of bytes read, less than n on timeout
+ */
+ssize_t ps2_read(void *buf, size_t n)
+{
+    return ps2_read_timeout(buf, n, PS2_READ_TIMEOUT_US);
+}
+
+
+/**
+ * Start sending a byte to the device.
+ *
+ * Returns immediately, the byte is shifted out by the EXTI
+ * interrupt.  Use ps2_write_status() to wait for completion.
+ *
+ * The device answers each byte, e.g. with 0xFA, and must not
+ * get the next command or argument before that.  So only one
+ * byte is sent per call, and the caller fetches the response
+ * with ps2_read() before writing the next one.
+ *
+ * \param  buf  byte to send
+ * \param  n    must be 1
+ * \return 1, or -1 if a transmission is still in progress
+ */
 ssize_t ps2_write(const void *buf, size_t n)
 {
-    const char *s = buf;
+    if (n != 1)
+        return -1;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if (tx_state != TX_IDLE) {
+        __set_PRIMASK(primask);
+        return -1;
+    }
+
+#if PS2_CAPTURE
+    cap_bytes = 0;
+    if (cap_state != CAP_OFF)
+        cap_stop();
+#endif
+
+    tx_data   = *(const uint8_t *)buf;
+    tx_status = PS2_TX_BUSY;
+
+    tx_request();
 
-    for (int i=0; i<n; i++)
-        ps2_send_byte(*s++);
+    __set_PRIMASK(primask);
 
     return n;
 }
 
 
+/**
+ * Get the result of the last ps2_write().
+ *
+ * \return PS2_TX_BUSY while sending, PS2_TX_DONE when the byte
+ *         was acknowledged, PS2_TX_NACK or PS2_TX_TIMEOUT
+ */
+int ps2_write_status(void)
+{
+    return tx_status;
+}
+
+
 void ps2_init(void)
 {
     // PB3      TP4_CLK
@@ -202,5 +757,54 @@ void ps2_init(void)
 
     NVIC_SetPriority(EXTI2_3_IRQn, 15);
     NVIC_EnableIRQ(EXTI2_3_IRQn);
+
+#if PS2_CAPTURE
+    // Same priority as EXTI, so the handlers don't preempt each other
+    //
+    RCC->APB2ENR |= RCC_APB2ENR_SPI1EN;
+
+    NVIC_SetPriority(SPI1_IRQn, 15);
+    NVIC_EnableIRQ(SPI1_IRQn);
+#endif
+}
+
+
+/**
+ * Release the bus before the device is powered down.
+ *
+ * CLK and DATA are switched to analog mode, so the pull-ups
+ * don't feed the unpowered device.  Call ps2_init() to restart.
+ */
+void ps2_deinit(void)
+{
+#if PS2_CAPTURE
+    cap_bytes = 0;
+    if (cap_state != CAP_OFF)
+        cap_stop();
+
+    NVIC_DisableIRQ(SPI1_IRQn);
+    RCC->APB2ENR &= ~RCC_APB2ENR_SPI1EN;
+#endif
+
+    // The interrupt stays enabled for the keyboard on EXTI2
+    //
+    EXTI->IMR &= ~PIN_CLK;
+
+    GPIOB->PUPDR &= ~(GPIO_PUPDR_PUPD3 | GPIO_PUPDR_PUPD4);
+    GPIOB->MODER |=   GPIO_MODER_MODE3 | GPIO_MODER_MODE4;
+
+    rx_frame = 0;
+    rx_frame_pos = 0;
+    rx_inhibited = false;
+    rx_resync = false;
+
+    while (rb_getchar(&rx_buf) >= 0);
+    rx_put_count = 0;
+    rx_get_count = 0;
+
+    if (tx_state != TX_IDLE) {
+        tx_state  = TX_IDLE;
+        tx_status = PS2_TX_TIMEOUT;
+    }
 }
 
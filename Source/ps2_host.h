@@ -3,6 +3,46 @@
 #include <unistd.h>
 #include <stdint.h>
 
+// Receive mouse packets with SPI1 instead of one interrupt per bit
+// Can be overridden from the Makefile, e.g. make PS2_CAPTURE=1
+//
+#ifndef PS2_CAPTURE
+#define PS2_CAPTURE         0
+#endif
+
+#define PS2_RX_BUFFER_SIZE  32
+#define PS2_READ_TIMEOUT_US 25000   // ps2_read() wait per byte
+
+// ps2_write_status() results
+//
+#define PS2_TX_DONE         0
+#define PS2_TX_BUSY         1
+#define PS2_TX_NACK         -1      // device did not acknowledge
+#define PS2_TX_TIMEOUT      -2      // device stopped clocking
+
+struct ps2_stats {
+    uint32_t rx_bytes;
+    uint32_t parity_errors;
+    uint32_t framing_errors;    // bad start or stop bit
+    uint32_t timeouts;          // clock paused within a frame
+    uint32_t overflows;         // receive buffer full
+    uint32_t tx_bytes;
+    uint32_t tx_errors;         // not acknowledged or timed out
+    uint32_t read_timeouts;     // no response within ps2_read() timeout
+    uint32_t irqs;              // EXTI and SPI interrupts
+    uint32_t irq_cycles;        // .. and CPU cycles spent in them
+    uint32_t capture_errors;    // SPI capture out of step with the frames
+};
+
+extern struct ps2_stats ps2_stats;
+
+size_t  ps2_rx_available(void);
+int     ps2_getchar(uint32_t *time);
 ssize_t ps2_read(void *buf, size_t n);
+ssize_t ps2_read_timeout(void *buf, size_t n, uint32_t timeout_us);
 ssize_t ps2_write(const void *buf, size_t n);
+int     ps2_write_status(void);
+void    ps2_capture(int n, uint32_t idle_us);
+void    ps2_tick(void);
 void    ps2_init(void);
+void    ps2_deinit(void);
@@ -0,0 +1,115 @@
+/**
+ * Nucular Keyboard - Statistics counters
+ * Copyright (C)2015 Thomas Kindler <mail_nucular@t-kindler.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stats.h"
+#include "cdc_console.h"
+#include "debounce.h"
+#include "kb_driver.h"
+#include "keyboard.h"
+#include "telemetry.h"
+#include "ps2_host.h"
+#include "trackpoint.h"
+#include "usbd_hid.h"
+#include "stm32l0xx.h"
+#include <stdio.h>
+#include <string.h>
+
+
+/**
+ * Print all counters on the debug channel.
+ *
+ * Used by the console "stats" command, and by Fn+Esc
+ * in builds without the console.
+ */
+void stats_print(void)
+{
+    const struct kb_scan_stats *s = &kb_scan_stats;
+    const struct kb_event_stats *e = &kb_event_stats;
+
+    printf("scan: frames %lu, dropped %lu, overruns %lu, time %lu us, sof error %d us\n",
+        s->frames, s->dropped, s->overruns, s->scan_time, (int)s->sof_error);
+
+    printf("ghost: keys %lu, frames %lu, wake: %lu, latency %lu/%lu us\n",
+        s->ghost_keys_total, s->ghost_frames, s->wakeups, s->wake_latency, s->wake_latency_max);
+
+    printf("events: queued %lu, processed %lu, overflows %lu, latency %lu/%lu us\n",
+        e->queued, e->processed, e->overflows, e->latency, e->latency_max);
+
+    printf("debounce: %lu/%lu cycles\n", debounce_stats.cycles, debounce_stats.cycles_max);
+
+    for (int ep=1; ep<8; ep++) {
+        const struct hid_ep_stats *h = &hid_ep_stats[ep];
+
+        if (h->reports || h->busy || h->staged) {
+            printf("ep 0x%02x: reports %lu, busy %lu, staged %lu, coalesced %lu, wait %lu/%lu us\n",
+                0x80 | ep, h->reports, h->busy, h->staged, h->coalesced,
+                h->reports ? h->wait_sum / h->reports : 0, h->wait_max);
+        }
+    }
+
+    printf("hid out: dropped %lu\n", hid_out_dropped);
+
+    printf("suspend: %lu, stop wake-ups %lu, remote wake-ups %lu, resume latency %lu/%lu us\n",
+        usb_suspend_stats.suspends, usb_suspend_stats.stop_wakeups, usb_suspend_stats.remote_wakeups,
+        usb_suspend_stats.resume_latency, usb_suspend_stats.resume_latency_max);
+
+    printf("ps2: rx %lu, parity %lu, framing %lu, timeouts %lu, overflows %lu\n",
+        ps2_stats.rx_bytes, ps2_stats.parity_errors, ps2_stats.framing_errors,
+        ps2_stats.timeouts, ps2_stats.overflows);
+
+    printf("ps2: tx %lu, errors %lu, read timeouts %lu\n",
+        ps2_stats.tx_bytes, ps2_stats.tx_errors, ps2_stats.read_timeouts);
+
+    printf("ps2: irqs %lu, cycles %lu, capture errors %lu, %s\n",
+        ps2_stats.irqs, ps2_stats.irq_cycles, ps2_stats.capture_errors,
+        PS2_CAPTURE ? "spi capture" : "bit-wise");
+
+    printf("tp: packets %lu, sync errors %lu, incomplete %lu, overflows %lu, resyncs %lu\n",
+        tp_stats.packets, tp_stats.sync_errors, tp_stats.incomplete,
+        tp_stats.overflows, tp_stats.resyncs);
+
+    printf("tlm: records %lu, dropped %lu, sent %lu\n",
+        tlm_stats.records, tlm_stats.dropped, tlm_stats.bytes_sent);
+
+#if USB_CDC_CONSOLE
+    printf("console: tx %lu, dropped %lu, rx %lu, dropped %lu\n",
+        cdc_console_stats.tx_bytes, cdc_console_stats.tx_dropped,
+        cdc_console_stats.rx_bytes, cdc_console_stats.rx_dropped);
+#endif
+}
+
+
+/**
+ * Reset all counters.
+ */
+void stats_clear(void)
+{
+    __disable_irq();
+    memset(&kb_event_stats, 0, sizeof(kb_event_stats));
+    memset(&debounce_stats, 0, sizeof(debounce_stats));
+    memset(hid_ep_stats, 0, sizeof(hid_ep_stats));
+    memset(&tlm_stats, 0, sizeof(tlm_stats));
+#if USB_CDC_CONSOLE
+    memset(&cdc_console_stats, 0, sizeof(cdc_console_stats));
+#endif
+    memset(&usb_suspend_stats, 0, sizeof(usb_suspend_stats));
+    memset(&ps2_stats, 0, sizeof(ps2_stats));
+    memset(&tp_stats, 0, sizeof(tp_stats));
+    hid_out_dropped = 0;
+    kb_scan_stats.wake_latency_max = 0;
+    __enable_irq();
+}
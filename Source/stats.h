@@ -0,0 +1,4 @@
+#pragma once
+
+void stats_print(void);
+void stats_clear(void);
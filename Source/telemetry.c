@@ -0,0 +1,142 @@
+/**
+ * Nucular Keyboard - Binary telemetry stream
+ * Copyright (C)2015 Thomas Kindler <mail_nucular@t-kindler.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "telemetry.h"
+#include "ringbuf.h"
+#include "ustime.h"
+#include "stm32l0xx.h"
+
+// Records are written from the scanner and PS/2 interrupts and read
+// from the USB interrupt, which sends them on the telemetry bulk
+// endpoint whenever the bus has time.  See Tools/tlm_read.py.
+//
+
+volatile uint32_t tlm_mask;
+struct tlm_stats tlm_stats;
+
+static struct ringbuf tlm_buf = RINGBUF(TLM_BUFFER_SIZE);
+static uint16_t tlm_seq;
+
+
+static void tlm_put(int type, const void *data, int len)
+{
+    struct tlm_header hdr = {
+        .type = type,
+        .len  = len,
+        .time = get_us_time32()
+    };
+
+    // tlm_buf needs locking, as there are multiple writers
+    //
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    hdr.seq = tlm_seq++;
+
+    if (rb_bytes_free(&tlm_buf) >= sizeof(hdr) + len) {
+        rb_write(&tlm_buf, &hdr, sizeof(hdr));
+        rb_write(&tlm_buf, data, len);
+        tlm_stats.records++;
+    }
+    else {
+        tlm_stats.dropped++;
+    }
+
+    __set_PRIMASK(primask);
+}
+
+
+/**
+ * Append a record to the telemetry stream.
+ *
+ * Safe to call from any context.  Records of types that are not
+ * enabled in tlm_mask are ignored.
+ *
+ * \param  type  record type, TLM_xxx
+ * \param  data  payload
+ * \param  len   payload length, 0..255
+ */
+void tlm_write(int type, const void *data, int len)
+{
+    if (tlm_mask & (1 << type))
+        tlm_put(type, data, len);
+}
+
+
+/**
+ * Get number of stream bytes waiting to be sent.
+ */
+int tlm_pending(void)
+{
+    return rb_bytes_used(&tlm_buf);
+}
+
+
+/**
+ * Read raw stream bytes.
+ *
+ * Records may be split across reads.  Must only be called from
+ * one context, i.e. the USB interrupt.
+ *
+ * \param  buf   where to store the bytes
+ * \param  size  maximum number of bytes
+ * \return number of bytes read
+ */
+int tlm_read(void *buf, int size)
+{
+    int len = rb_read(&tlm_buf, buf, size);
+
+    tlm_stats.bytes_sent += len;
+    return len;
+}
+
+
+/**
+ * Handle a command packet from the host.
+ *
+ * A new mask restarts the stream with a TLM_START record, which the
+ * host uses to find the first record boundary.
+ *
+ * \param  buf  packet data
+ * \param  len  packet length
+ */
+void tlm_command(const uint8_t *buf, int len)
+{
+    if (len >= 5 && buf[0] == TLM_CMD_SET_MASK) {
+        uint32_t mask = buf[1] | (buf[2] << 8) | (buf[3] << 16) | ((uint32_t)buf[4] << 24);
+
+        tlm_reset();
+        tlm_put(TLM_START, &mask, sizeof(mask));
+        tlm_mask = mask;
+    }
+}
+
+
+/**
+ * Stop recording and discard the buffered stream.
+ */
+void tlm_reset(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    tlm_mask = 0;
+    tlm_seq = 0;
+    tlm_buf.read_pos = tlm_buf.write_pos;
+
+    __set_PRIMASK(primask);
+}
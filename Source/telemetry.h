@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+// Telemetry record types, also used as bit numbers in tlm_mask
+//
+#define TLM_START       0       // stream started, uint32_t mask
+#define TLM_SCAN        1       // raw matrix frame, 16 sense bytes
+#define TLM_PS2_RX      2       // PS/2 frame received, struct tlm_ps2
+
+// Commands from the host on the telemetry OUT endpoint
+//
+#define TLM_CMD_SET_MASK    0x01    // uint32_t mask follows, resets the stream
+
+#ifndef TLM_BUFFER_SIZE
+#define TLM_BUFFER_SIZE     2048
+#endif
+
+
+// Every record starts with this header, followed by len payload bytes.
+// All fields are little-endian.
+//
+struct tlm_header {
+    uint8_t     type;
+    uint8_t     len;            // payload length
+    uint16_t    seq;            // record number, gaps mean dropped records
+    uint32_t    time;           // [us]
+};
+
+
+struct tlm_ps2 {
+    uint16_t    frame;          // start, 8 data bits, parity, stop
+    uint8_t     data;
+    uint8_t     error;          // 1: parity or framing error
+};
+
+
+struct tlm_stats {
+    uint32_t    records;        // records written to the buffer
+    uint32_t    dropped;        // records lost because the buffer was full
+    uint32_t    bytes_sent;     // bytes handed to the USB endpoint
+};
+
+
+extern volatile uint32_t tlm_mask;
+extern struct tlm_stats tlm_stats;
+
+void    tlm_write(int type, const void *data, int len);
+int     tlm_pending(void);
+int     tlm_read(void *buf, int size);
+void    tlm_command(const uint8_t *buf, int len);
+void    tlm_reset(void);
@@ -27,6 +27,52 @@
 #define PIN_RESET       GPIO_PIN_5
 #define PIN_PWR         GPIO_PIN_8
 
+// The self-test takes 500..750 ms after reset
+//
+#define TP_RESET_PULSE_US       1000
+#define TP_RESET_TIMEOUT_US     1000000
+
+// Packet assembler.  Bytes of a packet follow each other within
+// about 1 ms, so a partial packet is dropped after a longer pause.
+// Each lost status byte raises the error level by TP_SYNC_PENALTY,
+// each good packet lowers it by one.  If it reaches TP_RESYNC_LEVEL,
+// the stream is restarted.
+//
+#define TP_PACKET_TIMEOUT_US    5000
+#define TP_SYNC_PENALTY         4
+#define TP_RESYNC_LEVEL         16
+
+#define TP_RESYNC_QUIET_US      20000   // wait after disabling the stream
+#define TP_RESYNC_TIMEOUT_US    100000  // wait for 0xFA after enabling it
+
+// PS/2 mouse status byte
+//
+#define TP_STATUS_BUTTONS       0x07
+#define TP_STATUS_ALWAYS_1      0x08
+#define TP_STATUS_X_SIGN        0x10
+#define TP_STATUS_Y_SIGN        0x20
+#define TP_STATUS_X_OVERFLOW    0x40
+#define TP_STATUS_Y_OVERFLOW    0x80
+
+enum {
+    TP_STREAM,      // assembling packets
+    TP_RESET,       // reset pulse after power-up
+    TP_SELF_TEST,   // waiting for 0xAA 0x00
+    TP_DISABLE,     // sending 0xF5 (disable data reporting)
+    TP_FLUSH,       // discarding bytes until the device is quiet
+    TP_ENABLE       // sent 0xF4, waiting for the acknowledge
+};
+
+struct tp_stats tp_stats;
+
+static int      tp_state;
+static uint32_t tp_state_time;
+
+static uint8_t  tp_packet[3];
+static int      tp_packet_pos;
+static uint32_t tp_byte_time;
+static int      tp_error_level;
+
 // Fractional integrators for wheel/pan
 //
 #define WHEEL_SPEED     100
@@ -68,7 +114,11 @@ static int read_ram(int addr)
     ps2_write((char[]){ addr }, 1);
     ps2_read(&ack, 1);
 
-    return ps2_read(&ack, 1);
+    uint8_t data;
+    if (ps2_read(&data, 1) != 1)
+        return -1;
+
+    return data;
 }
 
 
@@ -89,12 +139,12 @@ void tp_reset(void)
     printf("tp_reset: ");
 
     GPIOB->BSRR = PIN_RESET;
-    delay_ms(1);
+    delay_us(TP_RESET_PULSE_US);
     GPIOB->BSRR = PIN_RESET << 16;
 
     uint8_t res[2];
 
-    int n = ps2_read(res, 2);
+    int n = ps2_read_timeout(res, 2, TP_RESET_TIMEOUT_US);
     if (n == 2) {
         // AA 00 - everything ok
         // FC 00 - something went wrong
@@ -121,23 +171,30 @@ void tp_clear_mouse_report(void)
 }
 
 
-void tp_update(void)
+/**
+ * Get the 9 bit movement value for one axis.
+ *
+ * On overflow, the device reports garbage in the low bits.
+ * The largest movement in the direction of the sign is used.
+ */
+static int packet_delta(int status, int data, int sign, int overflow)
 {
-    extern volatile int rx_buf;
-    if (rx_buf == -1)
-        return;
+    if (status & overflow) {
+        tp_stats.overflows++;
+        return (status & sign) ? -256 : 255;
+    }
 
-    struct {
-        uint8_t status;
-        int8_t  dx;
-        int8_t  dy;
-    } buf;
+    return (status & sign) ? data - 256 : data;
+}
 
-    ps2_read(&buf, sizeof(buf));
 
-    // TODO: Check bit 3 for errors!!
+static void handle_packet(const uint8_t *p)
+{
+    int status = p[0];
+    int dx = packet_delta(status, p[1], TP_STATUS_X_SIGN, TP_STATUS_X_OVERFLOW);
+    int dy = packet_delta(status, p[2], TP_STATUS_Y_SIGN, TP_STATUS_Y_OVERFLOW);
 
-    tp_mouse_report.buttons = buf.status & 7;
+    tp_mouse_report.buttons = status & TP_STATUS_BUTTONS;
 
     if (!kb_get_fn_key()) {
         // normal mouse movement, reset wheel/pan integrators.
@@ -145,16 +202,16 @@ void tp_update(void)
         dwheel_frac = 0;
         dpan_frac   = 0;
 
-        tp_mouse_report.dx = clamp(tp_mouse_report.dx + buf.dx, -127, 127);
-        tp_mouse_report.dy = clamp(tp_mouse_report.dy - buf.dy, -127, 127);
+        tp_mouse_report.dx = clamp(tp_mouse_report.dx + dx, -127, 127);
+        tp_mouse_report.dy = clamp(tp_mouse_report.dy - dy, -127, 127);
         tp_mouse_report.dwheel = 0;
         tp_mouse_report.dpan = 0;
     }
     else {
         // wheel/pan mode
         //
-        int dwheel = deadband(buf.dy, WHEEL_DEADBAND) * WHEEL_SPEED;
-        int dpan   = deadband(buf.dx, WHEEL_DEADBAND) * WHEEL_SPEED;
+        int dwheel = deadband(dy, WHEEL_DEADBAND) * WHEEL_SPEED;
+        int dpan   = deadband(dx, WHEEL_DEADBAND) * WHEEL_SPEED;
 
         // reset integrators when inside deadband
         //
@@ -169,7 +226,169 @@ void tp_update(void)
 }
 
 
-void tp_init(void)
+static void set_state(int state)
+{
+    tp_state = state;
+    tp_state_time = get_us_time32();
+    tp_packet_pos = 0;
+    tp_error_level = 0;
+}
+
+
+/**
+ * Restart the stream when packets are out of step, or
+ * bring it up after tp_power_up().
+ *
+ * Data reporting is disabled, everything still in flight is
+ * discarded, and reporting is enabled again.  The first byte
+ * after the acknowledge is a status byte.
+ */
+static void update_resync(void)
+{
+    uint32_t dt = get_us_time32() - tp_state_time;
+    uint8_t  c;
+
+    switch (tp_state) {
+    case TP_RESET:
+        if (dt > TP_RESET_PULSE_US) {
+            GPIOB->BSRR = PIN_RESET << 16;  // release reset
+            set_state(TP_SELF_TEST);
+        }
+        break;
+
+    case TP_SELF_TEST:
+        // AA 00 - everything ok
+        // FC 00 - something went wrong
+        //
+        // Either way, the result is flushed and the stream enabled.
+        //
+        if (ps2_rx_available() >= 2 || dt > TP_RESET_TIMEOUT_US)
+            set_state(TP_FLUSH);
+        break;
+
+    case TP_DISABLE:
+        if (ps2_write((char[]){ 0xF5 }, 1) > 0)
+            set_state(TP_FLUSH);
+        break;
+
+    case TP_FLUSH:
+        if (ps2_rx_available()) {
+            while (ps2_rx_available())
+                ps2_read(&c, 1);
+
+            set_state(TP_FLUSH);
+        }
+        else if (dt > TP_RESYNC_QUIET_US && ps2_write_status() != PS2_TX_BUSY) {
+            if (ps2_write((char[]){ 0xF4 }, 1) > 0)
+                set_state(TP_ENABLE);
+        }
+        break;
+
+    case TP_ENABLE:
+        while (ps2_rx_available()) {
+            ps2_read(&c, 1);
+            if (c == 0xFA) {
+                set_state(TP_STREAM);
+                ps2_capture(3, TP_PACKET_TIMEOUT_US);
+                return;
+            }
+        }
+
+        if (dt > TP_RESYNC_TIMEOUT_US)
+            set_state(TP_DISABLE);
+        break;
+    }
+}
+
+
+void tp_update(void)
+{
+    if (tp_state != TP_STREAM) {
+        update_resync();
+        return;
+    }
+
+    // Assemble packets from all received bytes.  Motion is
+    // accumulated in the mouse report until it is sent.
+    //
+    // Gaps are measured between arrival times, so bytes that
+    // piled up while the main loop was busy are not mistaken
+    // for a contiguous packet, or vice versa.
+    //
+    int c;
+    uint32_t t;
+
+    while ((c = ps2_getchar(&t)) >= 0) {
+        if (tp_packet_pos > 0 && t - tp_byte_time > TP_PACKET_TIMEOUT_US) {
+            // Gap within the packet, a byte was lost
+            //
+            tp_stats.incomplete++;
+            tp_packet_pos = 0;
+        }
+
+        tp_byte_time = t;
+
+        if (tp_packet_pos == 0 && !(c & TP_STATUS_ALWAYS_1)) {
+            // not a status byte, skip until we are in step again
+            //
+            tp_stats.sync_errors++;
+            tp_error_level += TP_SYNC_PENALTY;
+
+            if (tp_error_level >= TP_RESYNC_LEVEL) {
+                tp_stats.resyncs++;
+                set_state(TP_DISABLE);
+                return;
+            }
+            continue;
+        }
+
+        tp_packet[tp_packet_pos++] = c;
+
+        if (tp_packet_pos == 3) {
+            tp_packet_pos = 0;
+            tp_stats.packets++;
+
+            if (tp_error_level > 0)
+                tp_error_level--;
+
+            handle_packet(tp_packet);
+        }
+    }
+
+    // A byte of this packet was lost
+    //
+    if (tp_packet_pos > 0 && get_us_time32() - tp_byte_time > TP_PACKET_TIMEOUT_US) {
+        tp_stats.incomplete++;
+        tp_packet_pos = 0;
+    }
+}
+
+
+/**
+ * Power down the TrackPoint while the USB bus is suspended.
+ *
+ * Buttons are released in the mouse report, so none stays stuck
+ * on the host.  Use tp_power_up() to power up again.
+ */
+void tp_power_down(void)
+{
+    ps2_deinit();
+
+    GPIOB->BSRR = PIN_PWR;              // power off
+
+    // don't feed the unpowered chip through the reset pull-up
+    //
+    GPIOB->PUPDR &= ~GPIO_PUPDR_PUPD5;
+    GPIOB->MODER |=  GPIO_MODER_MODE5;
+
+    tp_mouse_report.buttons = 0;
+    tp_clear_mouse_report();
+
+    set_state(TP_STREAM);
+}
+
+
+static void power_on(void)
 {
     // PB5      TP4_RESET
     // PB8      +5V_TP_ON
@@ -185,6 +404,25 @@ void tp_init(void)
     } );
 
     ps2_init();
+}
+
+
+/**
+ * Power up the TrackPoint after tp_power_down().
+ *
+ * Unlike tp_init(), this doesn't wait for the self-test.  Reset,
+ * self-test and enabling the stream are done by tp_update().
+ */
+void tp_power_up(void)
+{
+    power_on();
+    set_state(TP_RESET);
+}
+
+
+void tp_init(void)
+{
+    power_on();
     tp_reset();
 
     uint8_t ack;
@@ -195,5 +433,8 @@ void tp_init(void)
     ps2_write((char[]){ 0xF4 }, 1);     // enable
     ps2_read(&ack, 1);                  // get response
 
+    set_state(TP_STREAM);
+    ps2_capture(3, TP_PACKET_TIMEOUT_US);
+
     // printf("response: %02x\n", ack);
 }
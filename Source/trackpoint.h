@@ -1,20 +1,25 @@
 #pragma once
 
 #include <stdint.h>
+#include "hid_reports.h"
 
-struct tp_mouse_report {
-    uint8_t buttons;
-    int8_t  dx;
-    int8_t  dy;
-    int8_t  dwheel;
-    int8_t  dpan;
+
+struct tp_stats {
+    uint32_t packets;
+    uint32_t sync_errors;       // bytes skipped, status bit 3 not set
+    uint32_t incomplete;        // partial packets dropped
+    uint32_t overflows;         // X or Y movement overflowed
+    uint32_t resyncs;           // stream restarted
 };
 
 
 extern struct tp_mouse_report tp_mouse_report;
+extern struct tp_stats tp_stats;
 
 
 void tp_clear_mouse_report(void);
 
 void tp_update(void);
+void tp_power_down(void);
+void tp_power_up(void);
 void tp_init(void);
@@ -0,0 +1,96 @@
+// Generated by usb_desc.py, do not edit
+//
+#pragma once
+
+
+// Endpoint addresses and packet sizes
+//
+#define HID_KEYBOARD_EPIN_ADDR          0x81
+#define HID_KEYBOARD_EPIN_SIZE          8
+#define HID_KEYBOARD_EPOUT_ADDR         0x01
+#define HID_KEYBOARD_EPOUT_SIZE         8
+
+#define HID_MOUSE_EPIN_ADDR             0x82
+#define HID_MOUSE_EPIN_SIZE             5
+
+#define HID_EXTRA_EPIN_ADDR             0x83
+#define HID_EXTRA_EPIN_SIZE             4
+#define HID_EXTRA_EPOUT_ADDR            0x03
+#define HID_EXTRA_EPOUT_SIZE            8
+
+#define CDC_CMD_EPIN_ADDR               0x84
+#define CDC_CMD_EPIN_SIZE               8
+
+#define CDC_DATA_EPIN_ADDR              0x87
+#define CDC_DATA_EP_SIZE                64
+#define CDC_DATA_EPOUT_ADDR             0x07
+
+#define HID_DEBUG_EPIN_ADDR             0x84
+#define HID_DEBUG_EPIN_SIZE             64
+
+#define HID_NKRO_EPIN_ADDR              0x85
+#define HID_NKRO_EPIN_SIZE              32
+
+#define HID_TELEMETRY_EPIN_ADDR         0x86
+#define HID_TELEMETRY_EP_SIZE           64
+#define HID_TELEMETRY_EPOUT_ADDR        0x06
+
+#define USB_NUM_ENDPOINTS               8
+
+
+// Interface numbers, configuration descriptor size
+//
+#define HID_KEYBOARD_INTERFACE          0
+#define HID_MOUSE_INTERFACE             1
+#define HID_EXTRA_INTERFACE             2
+#if USB_CDC_CONSOLE
+#define CDC_COMM_INTERFACE              3
+#define CDC_DATA_INTERFACE              4
+#define HID_NKRO_INTERFACE              5
+#define HID_TELEMETRY_INTERFACE         6
+#define USB_NUM_INTERFACES              7
+#define USB_HID_CONFIG_DESC_SIZ         212
+
+#define USB_PMA_TABLE(X) \
+    X(0x00, 0x040) \
+    X(0x80, 0x080) \
+    X(0x81, 0x0C0) \
+    X(0x01, 0x0C8) \
+    X(0x82, 0x0D0) \
+    X(0x83, 0x0D8) \
+    X(0x03, 0x0E0) \
+    X(0x84, 0x0E8) \
+    X(0x87, 0x0F0) \
+    X(0x07, 0x130) \
+    X(0x85, 0x170) \
+    X(0x86, 0x190) \
+    X(0x06, 0x1D0)
+#else
+#define HID_DEBUG_INTERFACE             3
+#define HID_NKRO_INTERFACE              4
+#define HID_TELEMETRY_INTERFACE         5
+#define USB_NUM_INTERFACES              6
+#define USB_HID_CONFIG_DESC_SIZ         171
+
+#define USB_PMA_TABLE(X) \
+    X(0x00, 0x040) \
+    X(0x80, 0x080) \
+    X(0x81, 0x0C0) \
+    X(0x01, 0x0C8) \
+    X(0x82, 0x0D0) \
+    X(0x83, 0x0D8) \
+    X(0x03, 0x0E0) \
+    X(0x84, 0x0E8) \
+    X(0x85, 0x128) \
+    X(0x86, 0x148) \
+    X(0x06, 0x188)
+#endif
+
+
+// Report descriptor sizes
+//
+#define HID_KEYBOARD_REPORT_DESC_SIZE   60
+#define HID_MOUSE_REPORT_DESC_SIZE      55
+#define HID_EXTRA_REPORT_DESC_SIZE      171
+#define HID_DEBUG_REPORT_DESC_SIZE      21
+#define HID_NKRO_REPORT_DESC_SIZE       39
@@ -37,6 +37,8 @@
 #include "stm32l0xx_hal.h"
 #include "usbd_def.h"
 #include "usbd_core.h"
+#include "kb_driver.h"
+#include "ustime.h"
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 /* Private macro -------------------------------------------------------------*/
@@ -45,6 +47,11 @@ PCD_HandleTypeDef hpcd_USB_FS;
 
 /* USER CODE BEGIN 0 */
 __IO uint32_t remotewakeupon=0;
+
+__IO uint32_t usb_sof_time;     // get_us_time32() at last SOF
+__IO uint32_t usb_sof_count;    // number of SOFs received
+
+struct usb_suspend_stats usb_suspend_stats;
 /* USER CODE END 0 */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -124,6 +131,13 @@ void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
   */
 void HAL_PCD_SOFCallback(PCD_HandleTypeDef *hpcd)
 {
+  usb_sof_time = get_us_time32();
+  usb_sof_count++;
+
+  // Keep the matrix scan phase-aligned to the USB frames
+  //
+  kb_scan_sync();
+
   USBD_LL_SOF(hpcd->pData);
 }
 
@@ -161,6 +175,7 @@ void HAL_PCD_ResetCallback(PCD_HandleTypeDef *hpcd)
 void HAL_PCD_SuspendCallback(PCD_HandleTypeDef *hpcd)
 {
   USBD_LL_Suspend(hpcd->pData);
+  usb_suspend_stats.suspends++;
   /*Enter in STOP mode */
   /* USER CODE BEGIN 2 */
   if (hpcd->Init.low_power_enable)
@@ -186,6 +201,11 @@ void HAL_PCD_ResumeCallback(PCD_HandleTypeDef *hpcd)
     SCB->SCR &= (uint32_t)~((uint32_t)(SCB_SCR_SLEEPDEEP_Msk | SCB_SCR_SLEEPONEXIT_Msk));    
   }
   remotewakeupon=0;
+
+  // The HAL resets the interrupt mask on wake-up
+  //
+  if (hpcd->Init.Sof_enable)
+    hpcd->Instance->CNTR |= USB_CNTR_SOFM;
   /* USER CODE END 3 */
   USBD_LL_Resume(hpcd->pData);
   
@@ -250,21 +270,25 @@ USBD_StatusTypeDef  USBD_LL_Init (USBD_HandleTypeDef *pdev)
   pdev->pData = &hpcd_USB_FS;
 
   hpcd_USB_FS.Instance = USB;
-  hpcd_USB_FS.Init.dev_endpoints = 8;
+  hpcd_USB_FS.Init.dev_endpoints = USB_NUM_ENDPOINTS;
   hpcd_USB_FS.Init.speed = PCD_SPEED_FULL;
   hpcd_USB_FS.Init.ep0_mps = DEP0CTL_MPS_64;
   hpcd_USB_FS.Init.phy_itface = PCD_PHY_EMBEDDED;
-  hpcd_USB_FS.Init.Sof_enable = DISABLE;
+  hpcd_USB_FS.Init.Sof_enable = ENABLE;
   hpcd_USB_FS.Init.low_power_enable = DISABLE;
   hpcd_USB_FS.Init.battery_charging_enable = DISABLE;
   HAL_PCD_Init(&hpcd_USB_FS);
 
-  HAL_PCDEx_PMAConfig(pdev->pData, 0x00, PCD_SNG_BUF, 0x40);    // Leave room for BTABLE entries
-  HAL_PCDEx_PMAConfig(pdev->pData, 0x80, PCD_SNG_BUF, 0x80);
-  HAL_PCDEx_PMAConfig(pdev->pData, 0x81, PCD_SNG_BUF, 0xC0);
-  HAL_PCDEx_PMAConfig(pdev->pData, 0x82, PCD_SNG_BUF, 0x100);
-  HAL_PCDEx_PMAConfig(pdev->pData, 0x83, PCD_SNG_BUF, 0x140);
-  HAL_PCDEx_PMAConfig(pdev->pData, 0x84, PCD_SNG_BUF, 0x180);
+  // The HAL does not enable the SOF interrupt by itself
+  //
+  if (hpcd_USB_FS.Init.Sof_enable)
+    hpcd_USB_FS.Instance->CNTR |= USB_CNTR_SOFM;
+
+  // Packet buffers are laid out by usb_desc.py, behind the BTABLE
+  //
+#define PMA_CONFIG(ep, addr)    HAL_PCDEx_PMAConfig(pdev->pData, ep, PCD_SNG_BUF, addr);
+  USB_PMA_TABLE(PMA_CONFIG)
+#undef PMA_CONFIG
 
   return USBD_OK;
 }
@@ -481,6 +505,46 @@ void  USBD_LL_Delay (uint32_t Delay)
 
 
 /* USER CODE BEGIN 4 */
+/**
+  * @brief  Signals remote wakeup to the host, if it allowed us to.
+  *         Blocks for USB_REMOTE_WAKEUP_MS.
+  * @param  None
+  * @retval 1 if resume signalling was sent, 0 otherwise
+  */
+int usb_remote_wakeup(void)
+{
+  USBD_HandleTypeDef *pdev = hpcd_USB_FS.pData;
+
+  if (pdev->dev_state != USBD_STATE_SUSPENDED || !pdev->dev_remote_wakeup)
+    return 0;
+
+  remotewakeupon = 1;
+
+  // Leave low-power mode and drive resume signalling for 1..15 ms.
+  // The USB interrupt also modifies CNTR.
+  //
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  hpcd_USB_FS.Instance->CNTR &= ~(USB_CNTR_LPMODE | USB_CNTR_FSUSP);
+  HAL_PCD_ActiveRemoteWakeup(&hpcd_USB_FS);
+  __set_PRIMASK(primask);
+
+  HAL_Delay(USB_REMOTE_WAKEUP_MS);
+
+  __disable_irq();
+  HAL_PCD_DeActiveRemoteWakeup(&hpcd_USB_FS);
+  __set_PRIMASK(primask);
+
+  // The host continues resume signalling and starts sending SOFs,
+  // but doesn't necessarily cause a WKUP interrupt.
+  //
+  if (pdev->dev_state == USBD_STATE_SUSPENDED)
+    USBD_LL_Resume(pdev);
+
+  usb_suspend_stats.remote_wakeups++;
+  return 1;
+}
+
 /**
   * @brief  Configures system clock after wake-up from USB Resume CallBack: 
   *         enable HSI, PLL and select PLL as system clock source.
@@ -6,7 +6,16 @@
 #include "stm32l0xx.h"
 #include "stm32l0xx_hal.h"
 
-#define USBD_MAX_NUM_INTERFACES     3
+// Debug console: 0 = HID debug interface (hid_listen), 1 = CDC-ACM serial port
+// Can be overridden from the Makefile, e.g. make USB_CDC_CONSOLE=1
+//
+#ifndef USB_CDC_CONSOLE
+#define USB_CDC_CONSOLE             0
+#endif
+
+#include "usb_desc.h"
+
+#define USBD_MAX_NUM_INTERFACES     (USB_NUM_INTERFACES - 1)    // highest interface number
 #define USBD_MAX_NUM_CONFIGURATION  1
 #define USBD_SUPPORT_USER_STRING    0
 
@@ -46,3 +55,28 @@
 #endif
 
 
+
+
+// USB frame timing, updated by HAL_PCD_SOFCallback()
+//
+#define USB_FRAME_US    1000
+
+extern __IO uint32_t usb_sof_time;
+extern __IO uint32_t usb_sof_count;
+
+
+// Suspend and remote wakeup, see usb_suspend() in main.c
+//
+#define USB_REMOTE_WAKEUP_MS    5   // resume signalling, 1..15 ms
+
+struct usb_suspend_stats {
+    uint32_t suspends;          // suspend events from the host
+    uint32_t stop_wakeups;      // exits from Stop mode while suspended
+    uint32_t remote_wakeups;    // resume signalling sent by us
+    uint32_t resume_latency;    // us from wake-up key to first report, last
+    uint32_t resume_latency_max;// .. and worst case
+};
+
+extern struct usb_suspend_stats usb_suspend_stats;
+
+int usb_remote_wakeup(void);
@@ -43,9 +43,15 @@ static uint8_t USBD_FS_DeviceDesc[USB_LEN_DEV_DESC] = {
     USB_LEN_DEV_DESC,           // bLength
     USB_DESC_TYPE_DEVICE,       // bDescriptorType
     0x00, 0x02,                 // bcdUSB
+#if USB_CDC_CONSOLE
+    0xEF,                       // bDeviceClass: Miscellaneous
+    0x02,                       // bDeviceSubClass: Common Class
+    0x01,                       // bDeviceProtocol: Interface Association
+#else
     0x00,                       // bDeviceClass
     0x00,                       // bDeviceSubClass
     0x00,                       // bDeviceProtocol
+#endif
     USB_MAX_EP0_SIZE,           // bMaxPacketSize
     LOBYTE(USBD_VID), HIBYTE(USBD_VID),   // idVendor
     LOBYTE(USBD_PID), HIBYTE(USBD_PID),   // idProduct
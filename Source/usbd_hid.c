@@ -18,373 +18,107 @@
 #include "usbd_hid.h"
 #include "usbd_desc.h"
 #include "usbd_ctlreq.h"
+#include "ustime.h"
+#include "ringbuf.h"
+#include "telemetry.h"
+#include "cdc_console.h"
+#include "util.h"
 #include <assert.h>
 
 
 #define WORD(x)     (x & 255), (x >> 8)
 
 
-// HID Keyboard report descriptor
-//
-static uint8_t KeyboardReportDesc[] = {
-    0x05, 0x01,         // Usage Page (Generic Desktop)
-    0x09, 0x06,         // Usage (Keyboard)
-    0xA1, 0x01,         // Collection (Application)
-    0x75, 0x01,         //     Report Size (1)
-    0x95, 0x08,         //     Report Count (8)
-    0x05, 0x07,         //     Usage Page (Keyboard/Keypad)
-    0x19, 0xE0,         //     Usage Minimum (Keyboard Left Control)
-    0x29, 0xE7,         //     Usage Maximum (Keyboard Right GUI)
-    0x15, 0x00,         //     Logical Minimum (0)
-    0x25, 0x01,         //     Logical Maximum (1)
-    0x81, 0x02,         //     Input (Data,Var,Abs,NWrp,Lin,Pref,NNul,Bit)
-    0x95, 0x01,         //     Report Count (1)
-    0x75, 0x08,         //     Report Size (8)
-    0x81, 0x01,         //     Input (Cnst,Ary,Abs)
-    0x95, 0x05,         //     Report Count (5)
-    0x75, 0x01,         //     Report Size (1)
-    0x05, 0x08,         //     Usage Page (LEDs)
-    0x19, 0x01,         //     Usage Minimum
-    0x29, 0x05,         //     Usage Maximum
-    0x91, 0x02,         //     Output (Data,Var,Abs,NWrp,Lin,Pref,NNul,NVol,Bit)
-    0x95, 0x01,         //     Report Count (1)
-    0x75, 0x03,         //     Report Size (3)
-    0x91, 0x01,         //     Output (Cnst,Ary,Abs,NWrp,Lin,Pref,NNul,NVol,Bit)
-    0x95, 0x06,         //     Report Count (6)
-    0x75, 0x08,         //     Report Size (8)
-    0x26, 0xFF, 0x00,   //     Logical Maximum (255)
-    0x05, 0x07,         //     Usage Page (Keyboard/Keypad)
-    0x19, 0x00,         //     Usage Minimum
-    0x29, 0xFF,         //     Usage Maximum
-    0x81, 0x00,         //     Input (Data,Ary,Abs)
-    0xC0                // End Collection
-};
+struct hid_ep_stats hid_ep_stats[8];
+uint32_t hid_out_dropped;
+
+static struct ringbuf hid_out_queue = RINGBUF(HID_OUT_QUEUE * sizeof(struct hid_out_report) + 1);
 
 
-// HID Mouse report descriptor
+// Report, HID and configuration descriptors, see Tools/usb_desc.py
 //
-static uint8_t MouseReportDesc[] = {
-    0x05, 0x01,         //  Usage Page (Generic Desktop)
-    0x09, 0x02,         //  Usage (Mouse)
-    0xA1, 0x01,         //  Collection (Application)
-    0x09, 0x01,         //      Usage (Pointer)
-    0xA1, 0x00,         //      Collection (Physical)
-    0x05, 0x09,         //          Usage Page (Button)
-    0x19, 0x01,         //          Usage Minimum (Button 1)
-    0x29, 0x08,         //          Usage Maximum (Button 8)
-    0x15, 0x00,         //          Logical Minimum (0)
-    0x25, 0x01,         //          Logical Maximum (1)
-    0x75, 0x01,         //          Report Size (1)
-    0x95, 0x08,         //          Report Count (8)
-    0x81, 0x02,         //          Input (Data,Var,Abs,NWrp,Lin,Pref,NNul,Bit)
-    0x05, 0x01,         //          Usage Page (Generic Desktop)
-    0x09, 0x30,         //          Usage (X)
-    0x09, 0x31,         //          Usage (Y)
-    0x09, 0x38,         //          Usage (Wheel)
-    0x15, 0x81,         //          Logical Minimum (-127)
-    0x25, 0x7F,         //          Logical Maximum (127)
-    0x75, 0x08,         //          Report Size (8)
-    0x95, 0x03,         //          Report Count (3)
-    0x81, 0x06,         //          Input (Data,Var,Rel,NWrp,Lin,Pref,NNul,Bit)
-    0x05, 0x0C,         //          Usage Page (Consumer Devices)
-    0x0A, 0x38, 0x02,   //          Usage (AC Pan)
-    0x95, 0x01,         //          Report Count (1)
-    0x81, 0x06,         //          Input (Data,Var,Rel,NWrp,Lin,Pref,NNul,Bit)
-    0xC0,               //      End Collection
-    0xC0,               //  End Collection
-};
+#include "usb_desc.inc"
 
 
-// Extra HID reports
-//
-static uint8_t ExtraReportDesc[] = {
-    // System control buttons
-    //
-    0x05, 0x01,         // Usage Page (Generic Desktop)
-    0x09, 0x80,         // Usage (System Control)
-    0xA1, 0x01,         // Collection (Application)
-    0x85, 0x01,         //     Report ID (1)
-    0x19, 0x81,         //     Usage Minimum (System Power Down)
-    0x29, 0x83,         //     Usage Maximum (System Wake Up)
-    0x09, 0xA8,         //     Usage (System Hibernate)
-    0x15, 0x00,         //     Logical Minimum (0)
-    0x25, 0x01,         //     Logical Maximum (1)
-    0x95, 0x04,         //     Report Count (4)
-    0x75, 0x01,         //     Report Size (1)
-    0x81, 0x02,         //     Input (Data,Var,Abs,NWrp,Lin,Pref,NNul,Bit)
-    0x95, 0x01,         //     Report Count (1)
-    0x75, 0x04,         //     Report Size (4)
-    0x81, 0x01,         //     Input (Cnst,Ary,Abs)
-    0xC0,               // End Collection
-
-    // Media control buttons
-    //
-    0x05, 0x0C,         // Usage Page (Consumer Devices)
-    0x09, 0x01,         // Usage (Consumer Control)
-    0xA1, 0x01,         // Collection (Application)
-    0x85, 0x02,         //     Report ID (2)
-    0x15, 0x00,         //     Logical Minimum (0)
-    0x25, 0x01,         //     Logical Maximum (1)
-    0x75, 0x01,         //     Report Size (1)
-    0x95, 0x08,         //     Report Count (8)
-
-    0x09, 0xE9,         //     Usage (Volume Increment)
-    0x09, 0xEA,         //     Usage (Volume Decrement)
-    0x09, 0xE2,         //     Usage (Mute)
-    0x09, 0xCD,         //     Usage (Play/Pause)
-    0x09, 0xB5,         //     Usage Minimum (Scan Next Track)
-    0x09, 0xB6,         //     Usage Minimum (Scan Previous Track)
-    0x09, 0xB7,         //     Usage Minimum (Stop)
-    0x09, 0xB8,         //     Usage Maximum (Eject)
-    0x81, 0x02,         //     Input (Data,Var,Abs,NWrp,Lin,Pref,NNul,Bit)
-
-    0x0A, 0x8A, 0x01,   //     Usage (AL Email Reader)
-    0x0A, 0x21, 0x02,   //     Usage (AC Search)
-    0x0A, 0x2A, 0x02,   //     Usage (AC Bookmarks)
-    0x0A, 0x23, 0x02,   //     Usage (AC Home)
-    0x0A, 0x24, 0x02,   //     Usage (AC_Back)
-    0x0A, 0x25, 0x02,   //     Usage (AC Forward)
-    0x0A, 0x26, 0x02,   //     Usage (AC Stop)
-    0x0A, 0x27, 0x02,   //     Usage (AC Refresh)
-    0x81, 0x02,         //     Input (Data,Var,Abs,NWrp,Lin,Pref,NNul,Bit)
-
-    0x0A, 0x83, 0x01,   //     Usage (AL Consumer Control Configuration)
-    0x0A, 0x96, 0x01,   //     Usage (AL Internet Browser)
-    0x0A, 0x92, 0x01,   //     Usage (AL Calculator)
-    0x0A, 0x9E, 0x01,   //     Usage (AL Terminal Lock/Screensaver)
-    0x0A, 0x94, 0x01,   //     Usage (AL Local Machine Browser)
-    0x0A, 0x06, 0x02,   //     Usage (AC Minimize)
-    0x09, 0x6F,         //     Usage (Brightness Increment, >= Win 8.1)
-    0x09, 0x70,         //     Usage (Brightness Decrement, >= Win 8.1)
-    0x81, 0x02,         //     Input (Data,Var,Abs,NWrp,Lin,Pref,NNul,Bit)
-    0xC0,               // End Collection
-
-    /*
-    // Mute, Power, etc. LEDs
-    //
-    0x05, 0x08,         // Usage Page (LEDs)
-    0x09, 0x01,         // Usage (Consumer Control)
-    0xA1, 0x01,         // Collection (Application)
-    0x85, 0x03,         //     Report ID (3)
-    0x15, 0x00,         //     Logical Minimum (0)
-    0x25, 0x01,         //     Logical Maximum (1)
-    0x09, 0x09,         //     Usage (Mute)
-    0x95, 0x01,         //     Report Count (1)
-    0x75, 0x01,         //     Report Size (1)
-    0x05, 0x08,         //     Usage Page (LEDs)
-    0x91, 0x02,         //     Output (Data,Var,Abs,NWrp,Lin,Pref,NNul,NVol,Bit)
-    0x95, 0x01,         //     Report Count (1)
-    0x75, 0x07,         //     Report Size (7)
-    0x91, 0x01,         //     Output (Cnst,Ary,Abs,NWrp,Lin,Pref,NNul,NVol,Bit)
-    0xC0                // End Collection
-    */
-
-    // HID detach for Bootloader (see UM0412)
-    // Does _not_ work in ST's DfuSe >= 3.0.3
-    //
-    0x06, 0x00, 0xFF,   // Vendor defined usage page - 0xFF00
-    0x09, 0x55,         // Usage (HID Detach)
-    0xA1, 0x01,         // Collection (Application)
-    0x85, 0x80,         // REPORT_ID (128)
-    0x09, 0x55,         // USAGE (HID Detach)
-    0x15, 0x00,         // LOGICAL_MINIMUM (0)
-    0x26, 0xFF, 0x00,   // LOGICAL_MAXIMUM (255)
-    0x75, 0x08,         // REPORT_SIZE (8 bits)
-    0x95, 0x01,         // REPORT_COUNT (1)
-    0xB1, 0x82,         // FEATURE (Data,Var,Abs,Vol)
-    0xC0,               // END_COLLECTION (Vendor defined)
-};
+#if USB_CDC_CONSOLE
 
+/**
+ * Re-arm the CDC OUT endpoint, or pause it until the console has
+ * read enough input.  While paused, the endpoint NAKs.
+ */
+static void hid_cdc_arm(USBD_HandleTypeDef *pdev)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
 
-// HID Debug (compatible with PJRC's hid_listen)
-//
-static uint8_t DebugReportDesc[] = {
-    0x06, 0x31, 0xff,   // Usage Page (Vendor-Defined)
-    0x09, 0x74,         // Usage (Vendor-Defined)
-    0xa1, 0x53,         // Collection
-    0x75, 0x08,         //     Report Size (8)
-    0x15, 0x00,         //     Logical Minimum (0)
-    0x26, 0xFF, 0x00,   //     Logical Maximum (255)
-    0x95, 0x3F,         //     Report Count (63)
-    0x09, 0x75,         //     Usage (Vendor-Defined)
-    0x81, 0x02,         //     Input (Data,Var,Abs,NWrp,Lin,Pref,NNul,Bit)
-//    0x09, 0x75,         //     Usage (Vendor-Defined 1)
-//    0x91, 0x02,         //     Output (Data,Var,Abs,NWrp,Lin,Pref,NNul,NVol,Bit)
-    0xc0                // End Collection
-};
+    hhid->cdc_out_paused = cdc_console_rx_free() < CDC_DATA_EP_SIZE;
 
+    if (!hhid->cdc_out_paused)
+        USBD_LL_PrepareReceive(pdev, CDC_DATA_EPOUT_ADDR, hhid->cdc_out_buf, CDC_DATA_EP_SIZE);
+}
 
-/* USB HID device Configuration Descriptor */
-static uint8_t USBD_HID_CfgDesc[USB_HID_CONFIG_DESC_SIZ] = {
-    USB_LEN_CFG_DESC,         /* bLength: Configuration Descriptor size */
-    USB_DESC_TYPE_CONFIGURATION, /* bDescriptorType: Configuration */
-    WORD(USB_HID_CONFIG_DESC_SIZ),  /* wTotalLength: Bytes returned */
-    0x04,         /*bNumInterfaces */
-    0x01,         /*bConfigurationValue: Configuration value*/
-    0x00,         /*iConfiguration: Index of string descriptor describing the configuration*/
-    0xA0,         /*bmAttributes: bus powered and Support Remote Wake-up */
-    0x32,         /*MaxPower 100 mA: this current is used for detecting Vbus*/
-
-
-
-    /************** Descriptor of Keyboard interface ****************/
-    USB_LEN_IF_DESC,         /*bLength: Interface Descriptor size*/
-    USB_DESC_TYPE_INTERFACE,/*bDescriptorType: Interface descriptor type*/
-    0x00,         /*bInterfaceNumber: Number of Interface*/
-    0x00,         /*bAlternateSetting: Alternate setting*/
-    0x01,         /*bNumEndpoints*/
-    0x03,         /*bInterfaceClass: HID*/
-    0x01,         /*bInterfaceSubClass : 1=BOOT, 0=no boot*/
-    0x01,         /*nInterfaceProtocol : 0=none, 1=keyboard, 2=mouse*/
-    0x00,         /*iInterface: Index of string descriptor*/
-
-    /******************** Descriptor of Keyboard HID ********************/
-    USB_LEN_HID_DESC,         /*bLength: HID Descriptor size*/
-    HID_DESCRIPTOR_TYPE, /*bDescriptorType: HID*/
-    0x11, 0x01,         /*bcdHID: HID Class Spec release number*/
-    0x00,         /*bCountryCode: Hardware target country*/
-    0x01,         /*bNumDescriptors: Number of HID class descriptors to follow*/
-    HID_REPORT_DESC,         /*bDescriptorType*/
-    WORD(HID_KEYBOARD_REPORT_DESC_SIZE), /*wItemLength: Total length of Report descriptor*/
-
-    /******************** Descriptor of Keyboard endpoint ********************/
-    USB_LEN_EP_DESC,          /*bLength: Endpoint Descriptor size*/
-    USB_DESC_TYPE_ENDPOINT, /*bDescriptorType:*/
-    HID_KEYBOARD_EPIN_ADDR,          /* bEndpointAddress: Endpoint Address (IN) */
-    0x03,                     /* bmAttributes: Interrupt endpoint */
-    WORD(HID_KEYBOARD_EPIN_SIZE),               /* wMaxPacketSize: 8 Byte max */
-    HID_KEYBOARD_POLLING_INTERVAL,       /* bInterval: Polling Interval (10 ms) */
-
-
-
-    /************** Descriptor of Mouse interface ****************/
-    USB_LEN_IF_DESC,         /*bLength: Interface Descriptor size*/
-    USB_DESC_TYPE_INTERFACE,/*bDescriptorType: Interface descriptor type*/
-    0x01,         /*bInterfaceNumber: Number of Interface*/
-    0x00,         /*bAlternateSetting: Alternate setting*/
-    0x01,         /*bNumEndpoints*/
-    0x03,         /*bInterfaceClass: HID*/
-    0x01,         /*bInterfaceSubClass : 1=BOOT, 0=no boot*/
-    0x02,         /*nInterfaceProtocol : 0=none, 1=keyboard, 2=mouse*/
-    0x00,         /*iInterface: Index of string descriptor*/
-
-    /******************** Descriptor of Mouse HID ********************/
-    USB_LEN_HID_DESC,         /*bLength: HID Descriptor size*/
-    HID_DESCRIPTOR_TYPE, /*bDescriptorType: HID*/
-    0x11, 0x01,        /*bcdHID: HID Class Spec release number*/
-    0x00,         /*bCountryCode: Hardware target country*/
-    0x01,         /*bNumDescriptors: Number of HID class descriptors to follow*/
-    HID_REPORT_DESC,         /*bDescriptorType*/
-    WORD(HID_MOUSE_REPORT_DESC_SIZE), /*wItemLength: Total length of Report descriptor*/
-
-    /******************** Descriptor of Mouse endpoint ********************/
-    USB_LEN_EP_DESC,              // bLength: Endpoint Descriptor size
-    USB_DESC_TYPE_ENDPOINT,       // bDescriptorType:
-    HID_MOUSE_EPIN_ADDR,          // bEndpointAddress: Endpoint Address (IN)
-    0x03,                         // bmAttributes: Interrupt endpoint
-    WORD(HID_MOUSE_EPIN_SIZE),    // wMaxPacketSize
-    HID_MOUSE_POLLING_INTERVAL,   // bInterval
-
-
-    // Extra function interface
-    //
-    USB_LEN_IF_DESC,                    // bLength: Interface Descriptor size
-    USB_DESC_TYPE_INTERFACE,            // bDescriptorType: Interface descriptor type
-    0x02,                               // bInterfaceNumber: Number of Interface
-    0x00,                               // bAlternateSetting: Alternate setting
-    0x01,                               // bNumEndpoints
-    0x03,                               // bInterfaceClass: HID
-    0x00,                               // bInterfaceSubClass : 1=BOOT, 0=no boot
-    0x00,                               // nInterfaceProtocol : 0=none, 1=keyboard, 2=mouse
-    0x00,                               // iInterface: Index of string descriptor
-
-    USB_LEN_HID_DESC,                   // bLength
-    HID_DESCRIPTOR_TYPE,                // bDescriptorType
-    0x11, 0x01,                         // bcdHID
-    0x00,                               // bCountryCode
-    0x01,                               // bNumDescriptors
-    HID_REPORT_DESC,                    // bDescriptorType
-    WORD(HID_EXTRA_REPORT_DESC_SIZE),   // wItemLength
-
-    USB_LEN_EP_DESC,                    // bLength
-    USB_DESC_TYPE_ENDPOINT,             // bDescriptorType
-    HID_EXTRA_EPIN_ADDR,                // bEndpointAddress
-    0x03,                               // bmAttributes: Interrupt endpoint
-    WORD(HID_EXTRA_EPIN_SIZE),          // wMaxPacketSize
-    HID_EXTRA_POLLING_INTERVAL,         // bInterval
-
-    // HID Debug Interface
-    //
-    USB_LEN_IF_DESC,                    // bLength: Interface Descriptor size
-    USB_DESC_TYPE_INTERFACE,            // bDescriptorType: Interface descriptor type
-    0x03,                               // bInterfaceNumber: Number of Interface
-    0x00,                               // bAlternateSetting: Alternate setting
-    0x01,                               // bNumEndpoints
-    0x03,                               // bInterfaceClass: HID
-    0x00,                               // bInterfaceSubClass : 1=BOOT, 0=no boot
-    0x00,                               // nInterfaceProtocol : 0=none, 1=keyboard, 2=mouse
-    0x00,                               // iInterface: Index of string descriptor
-
-    USB_LEN_HID_DESC,                   // bLength
-    HID_DESCRIPTOR_TYPE,                // bDescriptorType
-    0x11, 0x01,                         // bcdHID
-    0x00,                               // bCountryCode
-    0x01,                               // bNumDescriptors
-    HID_REPORT_DESC,                    // bDescriptorType
-    WORD(HID_DEBUG_REPORT_DESC_SIZE),   // wItemLength
-
-    USB_LEN_EP_DESC,                    // bLength
-    USB_DESC_TYPE_ENDPOINT,             // bDescriptorType
-    HID_DEBUG_EPIN_ADDR,                // bEndpointAddress
-    0x03,                               // bmAttributes: Interrupt endpoint
-    WORD(HID_DEBUG_EPIN_SIZE),          // wMaxPacketSize
-    HID_DEBUG_POLLING_INTERVAL          // bInterval
-};
 
+/**
+ * Send the next chunk of console output, if the endpoint is idle.
+ *
+ * Like the telemetry stream, transfers always end with a short packet.
+ */
+static void hid_cdc_tx(USBD_HandleTypeDef *pdev)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+    int ep = CDC_DATA_EPIN_ADDR & 0x0F;
 
-/* USB HID device Configuration Descriptor */
-static uint8_t USBD_HID_Desc_Mouse[USB_LEN_HID_DESC] = {
-    USB_LEN_HID_DESC,         /*bLength: HID Descriptor size*/
-    HID_DESCRIPTOR_TYPE, /*bDescriptorType: HID */
-    0x11, 0x01,   /*bcdHID: HID Class Spec release number*/
-    0x00,         /*bCountryCode: Hardware target country*/
-    0x01,         /*bNumDescriptors: Number of HID class descriptors to follow*/
-    HID_REPORT_DESC,         /*bDescriptorType*/
-    WORD(HID_MOUSE_REPORT_DESC_SIZE) /*wItemLength: Total length of Report descriptor*/
-};
+    if (hhid->ep_in_state[ep] != HID_IDLE)
+        return;
 
+    int len = MIN(cdc_console_tx_pending(), sizeof(hhid->cdc_in_buf));
+    if (len == 0)
+        return;
 
-static uint8_t USBD_HID_Desc_Keyboard[USB_LEN_HID_DESC] = {
-    USB_LEN_HID_DESC,         /*bLength: HID Descriptor size*/
-    HID_DESCRIPTOR_TYPE, /*bDescriptorType: HID*/
-    0x11, 0x01,        /*bcdHID: HID Class Spec release number*/
-    0x00,         /*bCountryCode: Hardware target country*/
-    0x01,         /*bNumDescriptors: Number of HID class descriptors to follow*/
-    HID_REPORT_DESC,         /*bDescriptorType*/
-    WORD(HID_KEYBOARD_REPORT_DESC_SIZE) /*wItemLength: Total length of Report descriptor*/
-};
+    if (len % CDC_DATA_EP_SIZE == 0)
+        len--;
 
+    len = cdc_console_tx(hhid->cdc_in_buf, len);
 
-static uint8_t USBD_HID_Desc_Extra[USB_LEN_HID_DESC] = {
-    USB_LEN_HID_DESC,               // bLength
-    HID_DESCRIPTOR_TYPE,            // bDescriptorType
-    0x11, 0x01,                     // bcdHID
-    0x00,                           // bCountryCode
-    0x01,                           // bNumDescriptors
-    HID_REPORT_DESC,                // bDescriptorType
-    WORD(HID_EXTRA_REPORT_DESC_SIZE)  // wItemLength
-};
+    hhid->ep_in_state[ep] = HID_BUSY;
+    USBD_LL_Transmit(pdev, CDC_DATA_EPIN_ADDR, hhid->cdc_in_buf, len);
+}
 
 
-static uint8_t USBD_HID_Desc_Debug[USB_LEN_HID_DESC] = {
-    USB_LEN_HID_DESC,               // bLength
-    HID_DESCRIPTOR_TYPE,            // bDescriptorType
-    0x11, 0x01,                     // bcdHID
-    0x00,                           // bCountryCode
-    0x01,                           // bNumDescriptors
-    HID_REPORT_DESC,                // bDescriptorType
-    WORD(HID_DEBUG_REPORT_DESC_SIZE)  // wItemLength
-};
+static uint8_t hid_cdc_setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+
+    switch (req->bRequest) {
+    case CDC_SET_LINE_CODING:
+        if (req->wLength == sizeof(hhid->cdc_line_coding)) {
+            hhid->ep0_out_req = *req;
+            USBD_CtlPrepareRx(pdev, hhid->ep0_out_buf, req->wLength);
+        }
+        else {
+            USBD_CtlError(pdev, req);
+        }
+        break;
+
+    case CDC_GET_LINE_CODING:
+        USBD_CtlSendData(pdev, hhid->cdc_line_coding, MIN(sizeof(hhid->cdc_line_coding), req->wLength));
+        break;
+
+    case CDC_SET_CONTROL_LINE_STATE:
+        hhid->cdc_line_state = req->wValue;
+        break;
+
+    case CDC_SEND_BREAK:
+        break;
+
+    default:
+        USBD_CtlError(pdev, req);
+        return USBD_FAIL;
+    }
+
+    return USBD_OK;
+}
+
+#endif
 
 
 /**
@@ -400,14 +134,52 @@ static uint8_t USBD_HID_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     USBD_LL_OpenEP(pdev, HID_KEYBOARD_EPIN_ADDR,  USBD_EP_TYPE_INTR, HID_KEYBOARD_EPIN_SIZE);
     USBD_LL_OpenEP(pdev, HID_MOUSE_EPIN_ADDR,     USBD_EP_TYPE_INTR, HID_MOUSE_EPIN_SIZE);
     USBD_LL_OpenEP(pdev, HID_EXTRA_EPIN_ADDR,     USBD_EP_TYPE_INTR, HID_EXTRA_EPIN_SIZE);
+    USBD_LL_OpenEP(pdev, HID_NKRO_EPIN_ADDR,      USBD_EP_TYPE_INTR, HID_NKRO_EPIN_SIZE);
+#if !USB_CDC_CONSOLE
     USBD_LL_OpenEP(pdev, HID_DEBUG_EPIN_ADDR,     USBD_EP_TYPE_INTR, HID_DEBUG_EPIN_SIZE);
+#endif
+
+    /* Open EP OUT */
+    USBD_LL_OpenEP(pdev, HID_KEYBOARD_EPOUT_ADDR, USBD_EP_TYPE_INTR, HID_KEYBOARD_EPOUT_SIZE);
+    USBD_LL_OpenEP(pdev, HID_EXTRA_EPOUT_ADDR,    USBD_EP_TYPE_INTR, HID_EXTRA_EPOUT_SIZE);
+
+    /* Open telemetry EPs */
+    USBD_LL_OpenEP(pdev, HID_TELEMETRY_EPIN_ADDR,  USBD_EP_TYPE_BULK, HID_TELEMETRY_EP_SIZE);
+    USBD_LL_OpenEP(pdev, HID_TELEMETRY_EPOUT_ADDR, USBD_EP_TYPE_BULK, HID_TELEMETRY_EP_SIZE);
+
+#if USB_CDC_CONSOLE
+    /* Open CDC EPs */
+    USBD_LL_OpenEP(pdev, CDC_CMD_EPIN_ADDR,        USBD_EP_TYPE_INTR, CDC_CMD_EPIN_SIZE);
+    USBD_LL_OpenEP(pdev, CDC_DATA_EPIN_ADDR,       USBD_EP_TYPE_BULK, CDC_DATA_EP_SIZE);
+    USBD_LL_OpenEP(pdev, CDC_DATA_EPOUT_ADDR,      USBD_EP_TYPE_BULK, CDC_DATA_EP_SIZE);
+#endif
 
     static USBD_HID_HandleTypeDef mem;
 
     memset(&mem, 0, sizeof(mem));
 
+    // Report protocol is the default after reset (HID1_11, 7.2.6)
+    //
+    memset(mem.Protocol, HID_PROTOCOL_REPORT, sizeof(mem.Protocol));
+
     pdev->pClassData = &mem;
 
+    USBD_LL_PrepareReceive(pdev, HID_KEYBOARD_EPOUT_ADDR, mem.keyboard_out_buf, HID_KEYBOARD_EPOUT_SIZE);
+    USBD_LL_PrepareReceive(pdev, HID_EXTRA_EPOUT_ADDR,    mem.extra_out_buf,    HID_EXTRA_EPOUT_SIZE);
+    USBD_LL_PrepareReceive(pdev, HID_TELEMETRY_EPOUT_ADDR, mem.tlm_out_buf,     HID_TELEMETRY_EP_SIZE);
+
+#if USB_CDC_CONSOLE
+    // 115200 baud, 1 stop bit, no parity, 8 data bits.  Only for show.
+    //
+    memcpy(mem.cdc_line_coding, (uint8_t[]) { 0x00, 0xC2, 0x01, 0x00, 0, 0, 8 }, 7);
+
+    hid_cdc_arm(pdev);
+#endif
+
+    // Don't send stale data to a new host
+    //
+    tlm_reset();
+
     return 0;
 }
 
@@ -425,7 +197,18 @@ static uint8_t USBD_HID_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     USBD_LL_CloseEP(pdev, HID_KEYBOARD_EPIN_ADDR);
     USBD_LL_CloseEP(pdev, HID_MOUSE_EPIN_ADDR);
     USBD_LL_CloseEP(pdev, HID_EXTRA_EPIN_ADDR);
-    USBD_LL_CloseEP(pdev, HID_DEBUG_EPIN_ADDR);
+    USBD_LL_CloseEP(pdev, HID_DEBUG_EPIN_ADDR);     // also CDC_CMD_EPIN_ADDR
+    USBD_LL_CloseEP(pdev, HID_NKRO_EPIN_ADDR);
+    USBD_LL_CloseEP(pdev, HID_KEYBOARD_EPOUT_ADDR);
+    USBD_LL_CloseEP(pdev, HID_EXTRA_EPOUT_ADDR);
+    USBD_LL_CloseEP(pdev, HID_TELEMETRY_EPIN_ADDR);
+    USBD_LL_CloseEP(pdev, HID_TELEMETRY_EPOUT_ADDR);
+#if USB_CDC_CONSOLE
+    USBD_LL_CloseEP(pdev, CDC_DATA_EPIN_ADDR);
+    USBD_LL_CloseEP(pdev, CDC_DATA_EPOUT_ADDR);
+#endif
+
+    tlm_reset();
 
     /* Free allocated memory */
     if (pdev->pClassData != NULL)
@@ -434,6 +217,58 @@ static uint8_t USBD_HID_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 }
 
 
+static int hid_out_room(void)
+{
+    return rb_bytes_free(&hid_out_queue) >= sizeof(struct hid_out_report);
+}
+
+
+static void hid_out_push(int iface, int type, int id, const uint8_t *data, int len)
+{
+    struct hid_out_report report = {
+        .iface = iface,
+        .type  = type,
+        .id    = id,
+        .len   = MIN(len, HID_OUT_MAX_LEN)
+    };
+
+    memcpy(report.data, data, report.len);
+
+    if (hid_out_room())
+        rb_write(&hid_out_queue, &report, sizeof(report));
+    else
+        hid_out_dropped++;
+}
+
+
+/**
+ * Re-arm an OUT endpoint, or pause it until the queue has room.
+ *
+ * While paused, the endpoint NAKs and the host will retry.
+ */
+static void hid_out_arm(USBD_HandleTypeDef *pdev, int ep)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+
+    if (!hid_out_room()) {
+        hhid->out_paused |= 1 << ep;
+        return;
+    }
+
+    hhid->out_paused &= ~(1 << ep);
+
+    switch (ep) {
+    case HID_KEYBOARD_EPOUT_ADDR:
+        USBD_LL_PrepareReceive(pdev, ep, hhid->keyboard_out_buf, HID_KEYBOARD_EPOUT_SIZE);
+        break;
+
+    case HID_EXTRA_EPOUT_ADDR:
+        USBD_LL_PrepareReceive(pdev, ep, hhid->extra_out_buf, HID_EXTRA_EPOUT_SIZE);
+        break;
+    }
+}
+
+
 /**
   * @brief  USBD_HID_Setup
   *         Handle the HID specific requests
@@ -447,26 +282,40 @@ static uint8_t USBD_HID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *re
 
     switch (req->bmRequest & USB_REQ_TYPE_MASK) {
     case USB_REQ_TYPE_CLASS:
+#if USB_CDC_CONSOLE
+        if (req->wIndex == CDC_COMM_INTERFACE)
+            return hid_cdc_setup(pdev, req);
+#endif
         switch (req->bRequest) {
 
         case HID_REQ_SET_PROTOCOL:
-            hhid->Protocol = req->wValue;
+            if (req->wIndex < USB_NUM_INTERFACES)
+                hhid->Protocol[req->wIndex] = req->wValue;
             break;
 
         case HID_REQ_GET_PROTOCOL:
-            USBD_CtlSendData(pdev, &hhid->Protocol, 1);
+            if (req->wIndex < USB_NUM_INTERFACES)
+                USBD_CtlSendData(pdev, &hhid->Protocol[req->wIndex], 1);
+            else
+                USBD_CtlError(pdev, req);
             break;
 
         case HID_REQ_SET_IDLE:
-            hhid->IdleState = req->wValue >> 8;
+            // The idle rate applies to all report IDs of an interface
+            //
+            if (req->wIndex < USB_NUM_INTERFACES)
+                hhid->IdleRate[req->wIndex] = req->wValue >> 8;
             break;
 
         case HID_REQ_GET_IDLE:
-            USBD_CtlSendData(pdev, &hhid->IdleState, 1);
+            if (req->wIndex < USB_NUM_INTERFACES)
+                USBD_CtlSendData(pdev, &hhid->IdleRate[req->wIndex], 1);
+            else
+                USBD_CtlError(pdev, req);
             break;
 
         case HID_REQ_SET_REPORT:
-            if (!hhid->ep0_out_req_ready) {
+            if (hid_out_room() && req->wLength <= sizeof(hhid->ep0_out_buf)) {
                 hhid->ep0_out_req = *req;
                 USBD_CtlPrepareRx(pdev, hhid->ep0_out_buf, req->wLength);
             }
@@ -475,14 +324,21 @@ static uint8_t USBD_HID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *re
             }
             break;
 
-        case HID_REQ_GET_REPORT:
-            // Not (yet) supported, stall endpoint.
-            //
-            // But according to HID1_11, 7.2:
+        case HID_REQ_GET_REPORT: {
+            // According to HID1_11, 7.2:
             //      This request is mandatory and must be supported by all devices.
             //
-            USBD_CtlError(pdev, req);
+            int len = hid_get_report(
+                req->wIndex, req->wValue >> 8, req->wValue & 0xff,
+                hhid->ep0_in_buf, sizeof(hhid->ep0_in_buf)
+            );
+
+            if (len > 0)
+                USBD_CtlSendData(pdev, hhid->ep0_in_buf, MIN(len, req->wLength));
+            else
+                USBD_CtlError(pdev, req);
             break;
+        }
 
         default:
             USBD_CtlError(pdev, req);
@@ -495,18 +351,24 @@ static uint8_t USBD_HID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *re
         case USB_REQ_GET_DESCRIPTOR:
             if (req->wValue >> 8 == HID_REPORT_DESC) {
                 switch(req->wIndex) {
-                case 0: USBD_CtlSendData(pdev, KeyboardReportDesc,  MIN(HID_KEYBOARD_REPORT_DESC_SIZE, req->wLength));  break;
-                case 1: USBD_CtlSendData(pdev, MouseReportDesc,     MIN(HID_MOUSE_REPORT_DESC_SIZE, req->wLength));     break;
-                case 2: USBD_CtlSendData(pdev, ExtraReportDesc,     MIN(HID_EXTRA_REPORT_DESC_SIZE, req->wLength));     break;
-                case 3: USBD_CtlSendData(pdev, DebugReportDesc,     MIN(HID_DEBUG_REPORT_DESC_SIZE, req->wLength));     break;
+                case HID_KEYBOARD_INTERFACE: USBD_CtlSendData(pdev, KeyboardReportDesc,  MIN(HID_KEYBOARD_REPORT_DESC_SIZE, req->wLength));  break;
+                case HID_MOUSE_INTERFACE:    USBD_CtlSendData(pdev, MouseReportDesc,     MIN(HID_MOUSE_REPORT_DESC_SIZE, req->wLength));     break;
+                case HID_EXTRA_INTERFACE:    USBD_CtlSendData(pdev, ExtraReportDesc,     MIN(HID_EXTRA_REPORT_DESC_SIZE, req->wLength));     break;
+#if !USB_CDC_CONSOLE
+                case HID_DEBUG_INTERFACE:    USBD_CtlSendData(pdev, DebugReportDesc,     MIN(HID_DEBUG_REPORT_DESC_SIZE, req->wLength));     break;
+#endif
+                case HID_NKRO_INTERFACE:     USBD_CtlSendData(pdev, NkroReportDesc,      MIN(HID_NKRO_REPORT_DESC_SIZE, req->wLength));      break;
                 }
             }
             else if (req->wValue >> 8 == HID_DESCRIPTOR_TYPE) {
                 switch(req->wIndex) {
-                case 0: USBD_CtlSendData(pdev, USBD_HID_Desc_Keyboard,  MIN(USB_LEN_HID_DESC, req->wLength));   break;
-                case 1: USBD_CtlSendData(pdev, USBD_HID_Desc_Mouse,     MIN(USB_LEN_HID_DESC, req->wLength));   break;
-                case 2: USBD_CtlSendData(pdev, USBD_HID_Desc_Extra,     MIN(USB_LEN_HID_DESC, req->wLength));   break;
-                case 3: USBD_CtlSendData(pdev, USBD_HID_Desc_Debug,     MIN(USB_LEN_HID_DESC, req->wLength));   break;
+                case HID_KEYBOARD_INTERFACE: USBD_CtlSendData(pdev, USBD_HID_Desc_Keyboard,  MIN(USB_LEN_HID_DESC, req->wLength));   break;
+                case HID_MOUSE_INTERFACE:    USBD_CtlSendData(pdev, USBD_HID_Desc_Mouse,     MIN(USB_LEN_HID_DESC, req->wLength));   break;
+                case HID_EXTRA_INTERFACE:    USBD_CtlSendData(pdev, USBD_HID_Desc_Extra,     MIN(USB_LEN_HID_DESC, req->wLength));   break;
+#if !USB_CDC_CONSOLE
+                case HID_DEBUG_INTERFACE:    USBD_CtlSendData(pdev, USBD_HID_Desc_Debug,     MIN(USB_LEN_HID_DESC, req->wLength));   break;
+#endif
+                case HID_NKRO_INTERFACE:     USBD_CtlSendData(pdev, USBD_HID_Desc_Nkro,      MIN(USB_LEN_HID_DESC, req->wLength));   break;
                 }
             }
             break;
@@ -531,15 +393,232 @@ static uint8_t *USBD_HID_GetCfgDesc(uint16_t *length)
 }
 
 
+static struct hid_tx_queue *hid_tx_queue(USBD_HID_HandleTypeDef *hhid, int ep)
+{
+    switch (ep | 0x80) {
+    case HID_EXTRA_EPIN_ADDR:   return &hhid->extra_queue;
+    default:                    return NULL;
+    }
+}
+
+
+static struct hid_tx_stage *hid_tx_stage(USBD_HID_HandleTypeDef *hhid, int ep)
+{
+    switch (ep | 0x80) {
+    case HID_MOUSE_EPIN_ADDR:   return &hhid->mouse_stage;
+#if !USB_CDC_CONSOLE
+    case HID_DEBUG_EPIN_ADDR:   return &hhid->debug_stage;
+#endif
+    default:                    return NULL;
+    }
+}
+
+
+static void hid_tx_start(USBD_HandleTypeDef *pdev, int ep, const void *report, int len, uint32_t t_ready)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+
+    hhid->ep_in_state[ep & 0x0F] = HID_BUSY;
+    hhid->ep_in_start_time[ep & 0x0F] = t_ready;
+    hhid->idle_frames[ep & 0x0F] = 0;
+
+    // Keep a copy for idle repeats
+    //
+    if ((ep | 0x80) == HID_KEYBOARD_EPIN_ADDR && len <= sizeof(hhid->keyboard_last) && report != hhid->keyboard_last) {
+        memcpy(hhid->keyboard_last, report, len);
+        hhid->keyboard_last_len = len;
+    }
+
+    if ((ep | 0x80) == HID_NKRO_EPIN_ADDR && len <= sizeof(hhid->nkro_last) && report != hhid->nkro_last) {
+        memcpy(hhid->nkro_last, report, len);
+        hhid->nkro_last_len = len;
+    }
+
+    USBD_LL_Transmit(pdev, ep, (void*)report, len);
+}
+
+
+/**
+ * Write the next pending report of a queue to its endpoint.
+ *
+ * Slots are served round-robin, so no report ID can starve the others.
+ * Must be called with the endpoint idle, from the USB interrupt or
+ * with interrupts disabled.
+ */
+static void hid_tx_refill(USBD_HandleTypeDef *pdev, int ep, struct hid_tx_queue *q)
+{
+    for (int i=0; i<HID_TX_SLOTS; i++) {
+        int n = (q->next + i) % HID_TX_SLOTS;
+        struct hid_tx_slot *slot = &q->slot[n];
+
+        if (slot->pending) {
+            slot->pending = 0;
+            q->next = (n + 1) % HID_TX_SLOTS;
+            hid_tx_start(pdev, ep, slot->buf, slot->len, slot->ready_time);
+            return;
+        }
+    }
+}
+
+
+/**
+ * Send the next chunk of the telemetry stream, if the endpoint is idle.
+ *
+ * Transfers are kept one byte short of a packet multiple, so each one
+ * ends with a short packet and completes a bulk read on the host.
+ * Called from the USB interrupt.
+ */
+static void hid_tlm_tx(USBD_HandleTypeDef *pdev)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+    int ep = HID_TELEMETRY_EPIN_ADDR & 0x0F;
+
+    if (hhid->ep_in_state[ep] != HID_IDLE)
+        return;
+
+    int len = MIN(tlm_pending(), sizeof(hhid->tlm_in_buf));
+    if (len == 0)
+        return;
+
+    if (len % HID_TELEMETRY_EP_SIZE == 0)
+        len--;
+
+    len = tlm_read(hhid->tlm_in_buf, len);
+
+    hhid->ep_in_state[ep] = HID_BUSY;
+    USBD_LL_Transmit(pdev, HID_TELEMETRY_EPIN_ADDR, hhid->tlm_in_buf, len);
+}
+
+
 static uint8_t USBD_HID_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
     USBD_HID_HandleTypeDef  *hhid = pdev->pClassData;
 
+    if ((epnum | 0x80) == HID_TELEMETRY_EPIN_ADDR) {
+        hhid->ep_in_state[epnum & 0x0F] = HID_IDLE;
+        hid_tlm_tx(pdev);
+        return USBD_OK;
+    }
+
+#if USB_CDC_CONSOLE
+    if ((epnum | 0x80) == CDC_DATA_EPIN_ADDR) {
+        hhid->ep_in_state[epnum & 0x0F] = HID_IDLE;
+        hid_cdc_tx(pdev);
+        return USBD_OK;
+    }
+#endif
+
+    struct hid_ep_stats *stats = &hid_ep_stats[epnum & 0x0F];
+
+    uint32_t wait = get_us_time32() - hhid->ep_in_start_time[epnum & 0x0F];
+
+    stats->reports++;
+    stats->wait = wait;
+    stats->wait_sum += wait;
+    if (wait > stats->wait_max)
+        stats->wait_max = wait;
+
     // Ensure that the FIFO is empty before a new transfer, this condition could
     // be caused by  a new transfer before the end of the previous transfer
     //
     hhid->ep_in_state[epnum & 0x0F] = HID_IDLE;
 
+    // Send the staged report right away.  The data is copied to
+    // packet memory, so the stage is free again on return.
+    //
+    struct hid_tx_stage *stage = hid_tx_stage(hhid, epnum);
+    if (stage && stage->len) {
+        hid_tx_start(pdev, epnum | 0x80, stage->buf, stage->len, stage->ready_time);
+        stage->len = 0;
+        return USBD_OK;
+    }
+
+    // Send the next queued report right away
+    //
+    struct hid_tx_queue *q = hid_tx_queue(hhid, epnum);
+    if (q)
+        hid_tx_refill(pdev, epnum | 0x80, q);
+
+    return USBD_OK;
+}
+
+
+/**
+ * Repeat the last report of an interface when its idle rate has expired.
+ *
+ * Mouse and debug reports are not repeated, because they don't
+ * describe a state.
+ */
+static void hid_idle_repeat(USBD_HandleTypeDef *pdev, int iface, int ep)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+
+    int frames = hhid->IdleRate[iface] * 4;
+    if (frames == 0)
+        return;
+
+    if (hhid->idle_frames[ep & 0x0F] < frames) {
+        hhid->idle_frames[ep & 0x0F]++;
+        return;
+    }
+
+    if (hhid->ep_in_state[ep & 0x0F] != HID_IDLE)
+        return;
+
+    uint32_t t = get_us_time32();
+
+    switch (ep) {
+    case HID_KEYBOARD_EPIN_ADDR:
+        if (hhid->keyboard_last_len && hhid->Protocol[HID_KEYBOARD_INTERFACE] == HID_PROTOCOL_BOOT)
+            hid_tx_start(pdev, ep, hhid->keyboard_last, hhid->keyboard_last_len, t);
+        break;
+
+    case HID_NKRO_EPIN_ADDR:
+        if (hhid->nkro_last_len && hhid->Protocol[HID_KEYBOARD_INTERFACE] == HID_PROTOCOL_REPORT)
+            hid_tx_start(pdev, ep, hhid->nkro_last, hhid->nkro_last_len, t);
+        break;
+
+    case HID_EXTRA_EPIN_ADDR:
+        // Re-queue the last state of every report ID
+        //
+        for (int i=0; i<HID_TX_SLOTS; i++) {
+            struct hid_tx_slot *slot = &hhid->extra_queue.slot[i];
+            if (slot->len && !slot->pending) {
+                slot->pending = 1;
+                slot->ready_time = t;
+            }
+        }
+        hid_tx_refill(pdev, ep, &hhid->extra_queue);
+        break;
+    }
+}
+
+
+/**
+ * Count frames for the idle rates (HID1_11, 7.2.4).
+ */
+static uint8_t USBD_HID_SOF(USBD_HandleTypeDef *pdev)
+{
+    if (pdev->pClassData == NULL || pdev->dev_state != USBD_STATE_CONFIGURED)
+        return USBD_OK;
+
+    hid_idle_repeat(pdev, HID_KEYBOARD_INTERFACE, HID_KEYBOARD_EPIN_ADDR);
+    hid_idle_repeat(pdev, HID_EXTRA_INTERFACE,    HID_EXTRA_EPIN_ADDR);
+    hid_idle_repeat(pdev, HID_NKRO_INTERFACE,     HID_NKRO_EPIN_ADDR);
+
+    // Restart the telemetry stream after it ran dry
+    //
+    hid_tlm_tx(pdev);
+
+#if USB_CDC_CONSOLE
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+
+    hid_cdc_tx(pdev);
+
+    if (hhid->cdc_out_paused)
+        hid_cdc_arm(pdev);
+#endif
+
     return USBD_OK;
 }
 
@@ -553,8 +632,52 @@ static uint8_t USBD_HID_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 static uint8_t USBD_HID_EP0_RxReady(USBD_HandleTypeDef *pdev)
 {
     USBD_HID_HandleTypeDef  *hhid = pdev->pClassData;
-    hhid->ep0_out_req_ready = 1;
+    struct usb_setup_req *req = &hhid->ep0_out_req;
+
+#if USB_CDC_CONSOLE
+    if (req->wIndex == CDC_COMM_INTERFACE) {
+        if (req->bRequest == CDC_SET_LINE_CODING)
+            memcpy(hhid->cdc_line_coding, hhid->ep0_out_buf, sizeof(hhid->cdc_line_coding));
+
+        return USBD_OK;
+    }
+#endif
+
+    hid_out_push(req->wIndex, req->wValue >> 8, req->wValue & 0xff, hhid->ep0_out_buf, req->wLength);
+
+    return USBD_OK;
+}
+
+
+static uint8_t USBD_HID_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+    USBD_HID_HandleTypeDef  *hhid = pdev->pClassData;
+
+    int len = USBD_LL_GetRxDataSize(pdev, epnum);
+
+    switch (epnum) {
+    case HID_KEYBOARD_EPOUT_ADDR:
+        hid_out_push(0, HID_REPORT_OUTPUT, 0, hhid->keyboard_out_buf, len);
+        break;
+
+    case HID_EXTRA_EPOUT_ADDR:
+        hid_out_push(2, HID_REPORT_OUTPUT, len ? hhid->extra_out_buf[0] : 0, hhid->extra_out_buf, len);
+        break;
+
+    case HID_TELEMETRY_EPOUT_ADDR:
+        tlm_command(hhid->tlm_out_buf, len);
+        USBD_LL_PrepareReceive(pdev, epnum, hhid->tlm_out_buf, HID_TELEMETRY_EP_SIZE);
+        return USBD_OK;
+
+#if USB_CDC_CONSOLE
+    case CDC_DATA_EPOUT_ADDR:
+        cdc_console_rx(hhid->cdc_out_buf, len);
+        hid_cdc_arm(pdev);
+        return USBD_OK;
+#endif
+    }
 
+    hid_out_arm(pdev, epnum);
     return USBD_OK;
 }
 
@@ -566,8 +689,8 @@ USBD_ClassTypeDef  USBD_HID = {
     NULL,                   // EP0_TxSent
     USBD_HID_EP0_RxReady,   // EP0_RxReady
     USBD_HID_DataIn,        // DataIn
-    NULL,                   // DataOut
-    NULL,                   // SOF
+    USBD_HID_DataOut,       // DataOut
+    USBD_HID_SOF,           // SOF
     NULL,                   // IsoINIncomplete
     NULL,                   // IsoOUTIncomplete
     NULL,                   // GetHSConfigDescriptor
@@ -584,11 +707,159 @@ uint8_t USBD_HID_SendReport(USBD_HandleTypeDef *pdev, int ep, const void *report
     if (pdev->dev_state != USBD_STATE_CONFIGURED)
         return USBD_FAIL;
 
-    if (hhid->ep_in_state[ep & 0x0F] != HID_IDLE)
+    // Remember when the first report became ready, to measure
+    // the time until the host has picked up the data.
+    //
+    if (!hhid->ep_in_ready[ep & 0x0F]) {
+        hhid->ep_in_ready[ep & 0x0F] = 1;
+        hhid->ep_in_ready_time[ep & 0x0F] = get_us_time32();
+    }
+
+    // The USB interrupt may start a transfer from a queue at any time,
+    // and the HAL can't be entered twice.
+    //
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if (hhid->ep_in_state[ep & 0x0F] != HID_IDLE) {
+        // Stage the report behind the one in flight, if there is room
+        //
+        struct hid_tx_stage *stage = hid_tx_stage(hhid, ep);
+
+        if (stage && !stage->len && len <= sizeof(stage->buf)) {
+            memcpy(stage->buf, report, len);
+            stage->len = len;
+            stage->ready_time = hhid->ep_in_ready_time[ep & 0x0F];
+
+            hhid->ep_in_ready[ep & 0x0F] = 0;
+            hid_ep_stats[ep & 0x0F].staged++;
+
+            __set_PRIMASK(primask);
+            return USBD_OK;
+        }
+
+        __set_PRIMASK(primask);
+        hid_ep_stats[ep & 0x0F].busy++;
         return USBD_BUSY;
+    }
 
-    hhid->ep_in_state[ep & 0x0F] = HID_BUSY;
-    USBD_LL_Transmit(pdev, ep, (void*)report, len);
+    hhid->ep_in_ready[ep & 0x0F] = 0;
+    hid_tx_start(pdev, ep, report, len, hhid->ep_in_ready_time[ep & 0x0F]);
 
+    __set_PRIMASK(primask);
     return USBD_OK;
 }
+
+
+/**
+ * Queue a report for an endpoint that is shared by several report IDs.
+ *
+ * A report that is still waiting in the queue is replaced by a newer
+ * one with the same ID.  Endpoints without a queue are sent directly.
+ *
+ * \param  pdev    device instance
+ * \param  ep      endpoint address
+ * \param  report  report data, starting with the report ID
+ * \param  len     report length
+ * \return USBD_OK, or USBD_FAIL if not configured or out of slots
+ */
+uint8_t USBD_HID_QueueReport(USBD_HandleTypeDef *pdev, int ep, const void *report, int len)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+
+    if (pdev->dev_state != USBD_STATE_CONFIGURED)
+        return USBD_FAIL;
+
+    struct hid_tx_queue *q = hid_tx_queue(hhid, ep);
+    if (!q)
+        return USBD_HID_SendReport(pdev, ep, report, len);
+
+    if (len < 1 || len > HID_TX_MAX_LEN)
+        return USBD_FAIL;
+
+    uint8_t id = *(const uint8_t *)report;
+    uint8_t ret = USBD_FAIL;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    for (int i=0; i<HID_TX_SLOTS; i++) {
+        struct hid_tx_slot *slot = &q->slot[i];
+
+        if (slot->len && slot->id != id)
+            continue;
+
+        if (slot->pending)
+            hid_ep_stats[ep & 0x0F].coalesced++;
+        else
+            slot->ready_time = get_us_time32();
+
+        memcpy(slot->buf, report, len);
+        slot->id  = id;
+        slot->len = len;
+        slot->pending = 1;
+
+        if (hhid->ep_in_state[ep & 0x0F] == HID_IDLE)
+            hid_tx_refill(pdev, ep, q);
+
+        ret = USBD_OK;
+        break;
+    }
+
+    __set_PRIMASK(primask);
+    return ret;
+}
+
+
+/**
+ * Check if a queued report is still waiting for its endpoint.
+ */
+int USBD_HID_QueuePending(USBD_HandleTypeDef *pdev, int ep)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+
+    if (!hhid)
+        return 0;
+
+    struct hid_tx_queue *q = hid_tx_queue(hhid, ep);
+    if (!q)
+        return 0;
+
+    for (int i=0; i<HID_TX_SLOTS; i++)
+        if (q->slot[i].pending)
+            return 1;
+
+    return 0;
+}
+
+
+/**
+ * Get the next output or feature report from the host.
+ *
+ * \param  pdev    device instance
+ * \param  report  where to store the report
+ * \return 1 if a report was read, 0 if the queue was empty
+ */
+int USBD_HID_GetOutReport(USBD_HandleTypeDef *pdev, struct hid_out_report *report)
+{
+    USBD_HID_HandleTypeDef *hhid = pdev->pClassData;
+
+    if (rb_bytes_used(&hid_out_queue) < sizeof(*report))
+        return 0;
+
+    rb_read(&hid_out_queue, report, sizeof(*report));
+
+    if (hhid && hhid->out_paused) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+
+        for (int ep=0; ep<8; ep++) {
+            if (hhid->out_paused & (1 << ep))
+                hid_out_arm(pdev, ep);
+        }
+
+        __set_PRIMASK(primask);
+    }
+
+    return 1;
+}
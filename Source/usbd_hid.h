@@ -3,29 +3,43 @@
 #include <stdint.h>
 #include "usbd_ioreq.h"
 #include "keyboard.h"
+#include "usb_desc.h"
 
-#define HID_KEYBOARD_EPIN_ADDR          0x81
-#define HID_KEYBOARD_EPIN_SIZE          8
+#define HID_TELEMETRY_TX_SIZE           256     // maximum bulk transfer
 
-#define HID_MOUSE_EPIN_ADDR             0x82
-#define HID_MOUSE_EPIN_SIZE             5
+#define CDC_CMD_POLLING_INTERVAL        16
+#define CDC_DATA_TX_SIZE                128     // maximum bulk transfer
 
-#define HID_EXTRA_EPIN_ADDR             0x83
-#define HID_EXTRA_EPIN_SIZE             4
+// Polling intervals [ms], 1..255
+// Can be overridden from the Makefile, e.g. -DHID_MOUSE_POLLING_INTERVAL=10
+//
+#ifndef HID_KEYBOARD_POLLING_INTERVAL
+#define HID_KEYBOARD_POLLING_INTERVAL   1
+#endif
 
-#define HID_DEBUG_EPIN_ADDR             0x84
-#define HID_DEBUG_EPIN_SIZE             64
+#ifndef HID_MOUSE_POLLING_INTERVAL
+#define HID_MOUSE_POLLING_INTERVAL      1
+#endif
 
-#define USB_HID_CONFIG_DESC_SIZ         109
-#define HID_KEYBOARD_REPORT_DESC_SIZE   sizeof(KeyboardReportDesc)
-#define HID_MOUSE_REPORT_DESC_SIZE      sizeof(MouseReportDesc)
-#define HID_EXTRA_REPORT_DESC_SIZE      sizeof(ExtraReportDesc)
-#define HID_DEBUG_REPORT_DESC_SIZE      sizeof(DebugReportDesc)
+#ifndef HID_EXTRA_POLLING_INTERVAL
+#define HID_EXTRA_POLLING_INTERVAL      1
+#endif
 
-#define HID_MOUSE_POLLING_INTERVAL      10
-#define HID_KEYBOARD_POLLING_INTERVAL   10
-#define HID_EXTRA_POLLING_INTERVAL      10
+#ifndef HID_DEBUG_POLLING_INTERVAL
 #define HID_DEBUG_POLLING_INTERVAL      1
+#endif
+
+#ifndef HID_NKRO_POLLING_INTERVAL
+#define HID_NKRO_POLLING_INTERVAL       1
+#endif
+
+#if HID_KEYBOARD_POLLING_INTERVAL < 1 || HID_KEYBOARD_POLLING_INTERVAL > 255 || \
+    HID_MOUSE_POLLING_INTERVAL    < 1 || HID_MOUSE_POLLING_INTERVAL    > 255 || \
+    HID_EXTRA_POLLING_INTERVAL    < 1 || HID_EXTRA_POLLING_INTERVAL    > 255 || \
+    HID_DEBUG_POLLING_INTERVAL    < 1 || HID_DEBUG_POLLING_INTERVAL    > 255 || \
+    HID_NKRO_POLLING_INTERVAL     < 1 || HID_NKRO_POLLING_INTERVAL     > 255
+#error "HID polling intervals must be 1..255 ms"
+#endif
 
 #define USB_LEN_HID_DESC                9
 
@@ -41,6 +55,79 @@
 #define HID_REQ_SET_REPORT              0x09
 #define HID_REQ_GET_REPORT              0x01
 
+#define HID_PROTOCOL_BOOT               0x00
+#define HID_PROTOCOL_REPORT             0x01
+
+#define HID_REPORT_INPUT                0x01
+#define HID_REPORT_OUTPUT               0x02
+#define HID_REPORT_FEATURE              0x03
+
+#define CDC_SET_LINE_CODING             0x20
+#define CDC_GET_LINE_CODING             0x21
+#define CDC_SET_CONTROL_LINE_STATE      0x22
+#define CDC_SEND_BREAK                  0x23
+
+
+// Output and feature reports from the host, received by SET_REPORT
+// or on an interrupt OUT endpoint, and queued for the main loop.
+//
+#define HID_OUT_QUEUE       8       // queue size [reports]
+#define HID_OUT_MAX_LEN     8
+
+struct hid_out_report {
+    uint8_t     iface;          // interface number
+    uint8_t     type;           // HID_REPORT_OUTPUT or HID_REPORT_FEATURE
+    uint8_t     id;             // report ID, 0 if not used
+    uint8_t     len;            // length of data
+    uint8_t     data[HID_OUT_MAX_LEN];  // report, including the ID
+};
+
+
+// Per-endpoint transfer statistics
+//
+struct hid_ep_stats {
+    uint32_t    reports;        // completed transfers
+    uint32_t    busy;           // send attempts on a busy endpoint
+    uint32_t    wait;           // last time from ready to completion [us]
+    uint32_t    wait_max;       // maximum wait time [us]
+    uint32_t    wait_sum;       // sum of wait times [us]
+    uint32_t    coalesced;      // queued reports replaced before sending
+    uint32_t    staged;         // reports accepted while the endpoint was busy
+};
+
+
+// Transmit queue, one slot per report ID
+//
+#define HID_TX_SLOTS        2
+#define HID_TX_MAX_LEN      HID_EXTRA_EPIN_SIZE
+
+struct hid_tx_slot {
+    uint8_t     id;             // report ID
+    uint8_t     len;            // 0: slot unused
+    uint8_t     pending;        // waiting for the endpoint
+    uint8_t     buf[HID_TX_MAX_LEN];
+    uint32_t    ready_time;
+};
+
+
+struct hid_tx_queue {
+    struct hid_tx_slot slot[HID_TX_SLOTS];
+    int         next;           // slot to check first
+};
+
+
+// Second report buffer for busy endpoints with a continuous stream of
+// reports.  The next report waits here while the current one is in
+// flight, and is written to packet memory as soon as it completes.
+//
+#define HID_STAGE_MAX_LEN   HID_DEBUG_EPIN_SIZE
+
+struct hid_tx_stage {
+    uint8_t     len;            // 0: empty
+    uint8_t     buf[HID_STAGE_MAX_LEN];
+    uint32_t    ready_time;
+};
+
 
 typedef enum {
     HID_IDLE,
@@ -50,20 +137,60 @@ typedef enum {
 
 typedef struct {
     HID_StateTypeDef ep_in_state[8];
+    uint32_t ep_in_ready_time[8];
+    uint32_t ep_in_start_time[8];
+    uint8_t  ep_in_ready[8];
+
+    struct hid_tx_queue extra_queue;
+    struct hid_tx_stage mouse_stage;
+    struct hid_tx_stage debug_stage;
+
+    // Last reports sent on the keyboard endpoints, for idle repeats
+    //
+    uint8_t  keyboard_last[HID_KEYBOARD_EPIN_SIZE];
+    uint8_t  nkro_last[HID_NKRO_EPIN_SIZE];
+    uint8_t  keyboard_last_len;
+    uint8_t  nkro_last_len;
+
+    uint16_t idle_frames[8];        // frames since the last report
+    uint8_t  ep0_in_buf[USB_MAX_EP0_SIZE];
 
     uint8_t ep0_out_buf[USB_MAX_EP0_SIZE];
     struct  usb_setup_req ep0_out_req;
-    uint8_t ep0_out_req_ready;
 
-    uint8_t Protocol;
-    uint8_t IdleState;
+    uint8_t keyboard_out_buf[HID_KEYBOARD_EPOUT_SIZE];
+    uint8_t extra_out_buf[HID_EXTRA_EPOUT_SIZE];
+    uint8_t out_paused;             // OUT endpoints waiting for queue space
+
+    uint8_t tlm_in_buf[HID_TELEMETRY_TX_SIZE];
+    uint8_t tlm_out_buf[HID_TELEMETRY_EP_SIZE];
+
+#if USB_CDC_CONSOLE
+    uint8_t cdc_in_buf[CDC_DATA_TX_SIZE];
+    uint8_t cdc_out_buf[CDC_DATA_EP_SIZE];
+    uint8_t cdc_line_coding[7];     // baud rate, stop bits, parity, data bits
+    uint8_t cdc_line_state;         // bit 0: DTR, bit 1: RTS
+    uint8_t cdc_out_paused;         // waiting for console input space
+#endif
+
+    uint8_t Protocol[USB_NUM_INTERFACES];
+    uint8_t IdleRate[USB_NUM_INTERFACES];   // 4 ms units, 0: infinite
     uint8_t AltSetting;
 
 } USBD_HID_HandleTypeDef;
 
 
 extern USBD_ClassTypeDef USBD_HID;
+extern struct hid_ep_stats hid_ep_stats[8];
+extern uint32_t hid_out_dropped;
 
 void enter_bootloader(void);
 
 uint8_t USBD_HID_SendReport(USBD_HandleTypeDef *pdev, int ep, const void *report, int len);
+uint8_t USBD_HID_QueueReport(USBD_HandleTypeDef *pdev, int ep, const void *report, int len);
+int     USBD_HID_QueuePending(USBD_HandleTypeDef *pdev, int ep);
+int     USBD_HID_GetOutReport(USBD_HandleTypeDef *pdev, struct hid_out_report *report);
+
+// Provided by the application, called from the USB interrupt
+//
+int     hid_get_report(int iface, int type, int id, uint8_t *buf, int size);
@@ -35,6 +35,11 @@ uint64_t get_us_time64(void)
     static uint16_t t0;
     static uint64_t tickcount;
 
+    // may be called from interrupt handlers
+    //
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
     uint16_t  t = TIM6->CNT;
     if (t < t0)
         tickcount += t + 0x10000 - t0;
@@ -43,7 +48,10 @@ uint64_t get_us_time64(void)
 
     t0 = t;
 
-    return tickcount;
+    uint64_t ret = tickcount;
+    __set_PRIMASK(primask);
+
+    return ret;
 }
 
 
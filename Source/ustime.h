@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include "stm32l0xx.h"
 
 uint64_t get_us_time64(void);
 uint32_t get_us_time32(void);
@@ -10,3 +11,29 @@ void     delay_ms(int ms);
 
 void     init_us_timer(void);
 
+
+/**
+ * Get CPU cycle counter for short measurements.
+ *
+ * \note  SysTick counts down and wraps every millisecond,
+ *        use get_cycles_since() to get the elapsed time.
+ */
+static inline uint32_t get_cycles(void)
+{
+    return SysTick->VAL;
+}
+
+
+/**
+ * Get number of CPU cycles since t0.
+ *
+ * \param  t0  value from get_cycles(), less than 1ms ago
+ */
+static inline uint32_t get_cycles_since(uint32_t t0)
+{
+    int dt = t0 - SysTick->VAL;
+    if (dt < 0)
+        dt += SysTick->LOAD + 1;
+
+    return dt;
+}
@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+#
+# Generate the key action table for keyboard.c
+#
+# Usage: key_tab.py Source/hid_reports.h Source/keyboard.h > Source/key_tab.inc
+#
+# Each matrix position is mapped to the report bit or keycode it
+# controls. Bit positions are taken from the report structs in
+# hid_reports.h (generated by usb_desc.py) and keyboard.h, where
+# each field is named after its usage id.
+#
+from __future__ import print_function
+import re
+import sys
+
+# Keyboard matrix for Lenovo T420 keyboards
+#
+usage_tab = [
+#      0         1         2         3         4         5         6         7
+    [ 0x070035, 0x07001e, 0x070014, 0x07002b, 0x070004, 0x070029, 0x07001d, 0x000000 ],  #  0
+    [ 0x07003a, 0x07001f, 0x07001a, 0x070039, 0x070016, 0x070064, 0x07001b, 0x000000 ],  #  1
+    [ 0x07003b, 0x070020, 0x070008, 0x07003c, 0x070007, 0x07003d, 0x070006, 0x000000 ],  #  2
+    [ 0x070022, 0x070021, 0x070015, 0x070017, 0x070009, 0x07000a, 0x070019, 0x070005 ],  #  3
+    [ 0x070023, 0x070024, 0x070018, 0x07001c, 0x07000d, 0x07000b, 0x070010, 0x070011 ],  #  4
+    [ 0x07002e, 0x070025, 0x07000c, 0x070030, 0x07000e, 0x07003f, 0x070036, 0x000000 ],  #  5
+    [ 0x070041, 0x070026, 0x070012, 0x070040, 0x07000f, 0x000000, 0x070037, 0x000000 ],  #  6
+    [ 0x07002d, 0x070027, 0x070013, 0x07002f, 0x070033, 0x070034, 0x070032, 0x070038 ],  #  7
+    [ 0x070042, 0x070043, 0x000000, 0x07002a, 0x070031, 0x07003e, 0x070028, 0x07002c ],  #  8
+    [ 0x070049, 0x070045, 0x000000, 0x0700e3, 0x000000, 0x000000, 0x000000, 0x07004f ],  #  9
+    [ 0x07004c, 0x070044, 0x0c00e9, 0x0c00ea, 0x0c00e2, 0x0c0192, 0x000000, 0x070051 ],  # 10
+    [ 0x07004b, 0x07004e, 0x0700e3, 0x000000, 0x070065, 0x000000, 0x0c0224, 0x0c0225 ],  # 11
+    [ 0x07004a, 0x07004d, 0x000000, 0x000000, 0x000000, 0x070052, 0x070048, 0x070050 ],  # 12
+    [ 0x000000, 0x070046, 0x070047, 0x000000, 0x000000, 0x0700e2, 0x000000, 0x0700e6 ],  # 13
+    [ 0x000000, 0x000000, 0x000000, 0x0700e1, 0x000000, 0x000000, 0x0700e5, 0x000000 ],  # 14
+    [ 0x0700e0, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x0700e4, 0x000000 ]   # 15
+]
+
+usage_tab_fn = [
+#        0           1         2         3         4         5         6         7
+    [   0x000000,   0x000000, 0x000000, 0x000000, 0x000000, 0xff000003, 0x000000, 0x000000 ],  #  0
+    [   0x000000,   0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000 ],  #  1
+    [   0x000000,   0x000000, 0x000000, 0x000000, 0x000000, 0x010082, 0x000000, 0x000000 ],  #  2
+    [   0x000000,   0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000 ],  #  3
+    [   0x000000,   0x07005f, 0x07005c, 0x000000, 0x070059, 0x000000, 0x070062, 0x000000 ],  #  4
+    [   0x000000,   0x070060, 0x07005d, 0x000000, 0x07005a, 0x000000, 0x000000, 0x000000 ],  #  5
+    [   0x000000,   0x070061, 0x07005e, 0x000000, 0x07005b, 0x000000, 0x070063, 0x000000 ],  #  6
+    [   0x000000,   0x070054, 0x070055, 0x000000, 0x070056, 0x000000, 0x000000, 0x070057 ],  #  7
+    [   0x000000,   0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x070058, 0x000000 ],  #  8
+    [   0x000000,   0x0100a8, 0x000000, 0x0700e7, 0x000000, 0x000000, 0x000000, 0x0c00b5 ],  #  9
+    [   0x000000,   0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x0c00cd ],  # 10
+    [ 0xff000001, 0xff000002, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000 ],  # 11
+    [   0x0c006f,   0x0c0070, 0x000000, 0x000000, 0x000000, 0x0c00b7, 0x000000, 0x0c00b6 ],  # 12
+    [   0x000000,   0x000000, 0x070053, 0x000000, 0x000000, 0x0700e2, 0x000000, 0x0700e6 ],  # 13
+    [   0x000000,   0x000000, 0x000000, 0x0700e1, 0x000000, 0x000000, 0x0700e5, 0x000000 ],  # 14
+    [   0x0700e0,   0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x0700e4, 0x000000 ]   # 15
+]
+
+# Usages that are not mapped to the matrix
+#
+extra_usages = [
+    ("key_power_down", 0x010081)
+]
+
+# Report structs and their usage pages
+#
+reports = [
+    ("KEY_KEYBOARD", "kb_in_report",        0x07),
+    ("KEY_SYSCTRL",  "kb_sysctrl_report",   0x01),
+    ("KEY_CONSUMER", "kb_consumer_report",  0x0c),
+    ("KEY_MISC",     "kb_misc_keys",        0xff00)
+]
+
+
+def parse_report(header, struct_name):
+    """Return a {usage_id: (offset, mask)} dict for a report struct"""
+
+    m = re.search(r"struct\s+%s\s*{(.*?)};" % struct_name, header, re.S)
+    if not m:
+        sys.exit("struct %s not found" % struct_name)
+
+    bits = {}
+    pos = 0
+
+    for line in m.group(1).splitlines():
+        line = line.split("//")[0].strip()
+
+        f = re.match(r"unsigned\s+(\w+)\s*:\s*(\d+);", line)
+        if f:
+            u = re.match(r"_([0-9a-f]+)_", f.group(1))
+            if u:
+                bits[int(u.group(1), 16)] = (pos // 8, 1 << (pos % 8))
+            pos += int(f.group(2))
+            continue
+
+        f = re.match(r"uint8_t\s+\w+\s*(?:\[(\d+)\])?;", line)
+        if f:
+            pos = (pos + 7) // 8 * 8
+            pos += 8 * int(f.group(1) or 1)
+
+    return bits
+
+
+def main():
+    header = "".join(open(name).read() for name in sys.argv[1:])
+
+    layout = {}
+    for name, struct_name, page in reports:
+        for usage_id, (offset, mask) in parse_report(header, struct_name).items():
+            layout[(page << 16) | usage_id] = (name, offset, mask)
+
+    refs = {}
+
+    def action(usage):
+        if usage == 0:
+            target, ref = ("KEY_NONE", 0, 0), 0
+        elif usage in layout:
+            target = layout[usage]
+            ref = refs.setdefault(target, len(refs))
+        elif usage >> 16 == 0x07 and usage & 0xffff <= 0xff:
+            target, ref = ("KEY_ARRAY", 0, usage & 0xff), 0
+        else:
+            sys.exit("unknown usage %08x" % usage)
+
+        return "%-13s 0x%02x, 0x%02x, %2d" % (target[0] + ",", target[1], target[2], ref)
+
+    print("// Generated by key_tab.py from %s" % ", ".join(sys.argv[1:]))
+    print("//")
+    print("static const struct key_action key_tab[2][16][8] = {")
+
+    for tab in [usage_tab, usage_tab_fn]:
+        print("    {")
+        for d in range(16):
+            print("        {")
+            for s in range(8):
+                print("            { %s },  // %2d/%d  %08x" % (action(tab[d][s]), d, s, tab[d][s]))
+            print("        },")
+        print("    },")
+
+    print("};")
+    print()
+
+    for name, usage in extra_usages:
+        print("static const struct key_action %s = { %s };  // %08x" % (name, action(usage), usage))
+
+    print()
+    print("#define KEY_NUM_REFS    %d" % len(refs))
+
+
+main()
@@ -0,0 +1,212 @@
+#!/usr/bin/env python
+#
+# Read the telemetry stream of the Nucular Keyboard
+#
+# Usage: tlm_read.py [-t scan,ps2] [-w capture.bin]   read from the keyboard
+#        tlm_read.py -r capture.bin                   decode a recorded capture
+#
+# Needs pyusb to talk to the keyboard.  On Windows, the telemetry
+# interface must be bound to WinUSB first (e.g. with Zadig).
+#
+# The stream format is described in Source/telemetry.h.  A capture
+# file is the raw stream as received, starting at any byte offset.
+#
+from __future__ import print_function
+import argparse
+import struct
+import sys
+import time
+
+USB_VID     = 0x1d50
+USB_PID     = 0x60c0
+EP_IN       = 0x86
+EP_OUT      = 0x06
+READ_SIZE   = 256
+
+TLM_START   = 0
+TLM_SCAN    = 1
+TLM_PS2_RX  = 2
+
+TLM_CMD_SET_MASK = 0x01
+
+record_names = {
+    TLM_START:  "start",
+    TLM_SCAN:   "scan",
+    TLM_PS2_RX: "ps2"
+}
+
+header = struct.Struct("<BBHI")
+
+
+class Decoder(object):
+    """Split the byte stream into records"""
+
+    def __init__(self, on_record):
+        self.buf = bytearray()
+        self.synced = False
+        self.on_record = on_record
+
+        self.next_seq = None
+        self.records = 0
+        self.dropped = 0
+        self.skipped = 0
+        self.counts = {}
+
+    def find_start(self):
+        # A TLM_START record with seq 0 marks the beginning of a stream
+        #
+        pos = self.buf.find(b"\x00\x04\x00\x00")
+        if pos < 0:
+            keep = min(len(self.buf), 3)
+            self.skipped += len(self.buf) - keep
+            del self.buf[:len(self.buf) - keep]
+            return False
+
+        self.skipped += pos
+        del self.buf[:pos]
+        self.synced = True
+        return True
+
+    def feed(self, data):
+        self.buf += data
+
+        if not self.synced and not self.find_start():
+            return
+
+        while len(self.buf) >= header.size:
+            rtype, rlen, seq, t = header.unpack_from(self.buf)
+            if len(self.buf) < header.size + rlen:
+                break
+
+            payload = bytes(self.buf[header.size:header.size + rlen])
+            del self.buf[:header.size + rlen]
+
+            if rtype == TLM_START:
+                self.next_seq = seq
+
+            if seq != self.next_seq:
+                self.dropped += (seq - self.next_seq) & 0xffff
+
+            self.next_seq = (seq + 1) & 0xffff
+            self.records += 1
+            self.counts[rtype] = self.counts.get(rtype, 0) + 1
+
+            self.on_record(rtype, seq, t, payload)
+
+
+def format_record(rtype, seq, t, payload):
+    name = record_names.get(rtype, "type%d" % rtype)
+
+    if rtype == TLM_START:
+        mask, = struct.unpack("<I", payload)
+        text = "mask 0x%08x" % mask
+
+    elif rtype == TLM_SCAN:
+        text = " ".join("%x:%02x" % (row, b) for row, b in enumerate(bytearray(payload)) if b)
+
+    elif rtype == TLM_PS2_RX:
+        frame, data, error = struct.unpack("<HBB", payload)
+        text = "0x%02x  frame 0x%03x%s" % (data, frame, "  ERROR" if error else "")
+
+    else:
+        text = " ".join("%02x" % b for b in bytearray(payload))
+
+    return "%10.6f  %5d  %-5s  %s" % (t / 1e6, seq, name, text)
+
+
+def print_summary(dec, nbytes, seconds):
+    print("", file=sys.stderr)
+    print("%d bytes, %d records, %d dropped, %d bytes skipped" %
+        (nbytes, dec.records, dec.dropped, dec.skipped), file=sys.stderr)
+
+    for rtype, n in sorted(dec.counts.items()):
+        print("  %-6s %d" % (record_names.get(rtype, rtype), n), file=sys.stderr)
+
+    if seconds:
+        print("%.1f KB/s" % (nbytes / seconds / 1024), file=sys.stderr)
+
+
+def read_file(args, dec):
+    data = open(args.read, "rb").read()
+    dec.feed(data)
+
+    return len(data), 0
+
+
+def read_device(args, dec):
+    import usb.core
+    import usb.util
+
+    dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+    if dev is None:
+        sys.exit("keyboard not found")
+
+    # The interface number depends on the firmware build options
+    #
+    intf = usb.util.find_descriptor(dev.get_active_configuration(), bInterfaceClass=0xff)
+    if intf is None:
+        sys.exit("telemetry interface not found")
+
+    usb.util.claim_interface(dev, intf)
+
+    mask = 0
+    for name in args.types.split(","):
+        rtype = [k for k, v in record_names.items() if v == name]
+        if not rtype:
+            sys.exit("unknown record type %s" % name)
+        mask |= 1 << rtype[0]
+
+    capture = open(args.write, "wb") if args.write else None
+    nbytes = 0
+    t0 = time.time()
+
+    dev.write(EP_OUT, struct.pack("<BI", TLM_CMD_SET_MASK, mask))
+
+    try:
+        while True:
+            try:
+                data = dev.read(EP_IN, READ_SIZE, timeout=100)
+            except usb.core.USBTimeoutError:
+                continue
+
+            data = bytearray(data)
+            nbytes += len(data)
+
+            if capture:
+                capture.write(data)
+
+            dec.feed(data)
+
+    except KeyboardInterrupt:
+        pass
+
+    finally:
+        dev.write(EP_OUT, struct.pack("<BI", TLM_CMD_SET_MASK, 0))
+        usb.util.release_interface(dev, intf)
+
+    return nbytes, time.time() - t0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Read the keyboard telemetry stream")
+    parser.add_argument("-t", "--types", default="scan,ps2", help="record types to enable")
+    parser.add_argument("-w", "--write", help="save the raw stream to a capture file")
+    parser.add_argument("-r", "--read", help="decode a capture file instead of the keyboard")
+    parser.add_argument("-q", "--quiet", action="store_true", help="only print the summary")
+    args = parser.parse_args()
+
+    def on_record(rtype, seq, t, payload):
+        if not args.quiet:
+            print(format_record(rtype, seq, t, payload))
+
+    dec = Decoder(on_record)
+
+    if args.read:
+        nbytes, seconds = read_file(args, dec)
+    else:
+        nbytes, seconds = read_device(args, dec)
+
+    print_summary(dec, nbytes, seconds)
+
+
+main()
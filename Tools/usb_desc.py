@@ -0,0 +1,894 @@
+#!/usr/bin/env python
+#
+# Generate the USB descriptors and HID report structs
+#
+# Usage: usb_desc.py Source
+#
+# Writes from the interface and report definitions below:
+#
+#   usb_desc.h      interface numbers, endpoints, descriptor sizes
+#                   and the packet memory layout
+#   usb_desc.inc    report, HID and configuration descriptors
+#   hid_reports.h   C structs of the reports
+#
+# Report struct members of single-bit usages are named after their
+# usage id, so key_tab.py can map keys to report bits.
+#
+# Interfaces can depend on USB_CDC_CONSOLE.  Interface numbers,
+# descriptor size and PMA layout are generated for both settings.
+#
+from __future__ import print_function
+import os
+import re
+import sys
+
+# Main item types
+#
+INPUT   = 0x80
+OUTPUT  = 0x90
+FEATURE = 0xB0
+
+# Main item flags
+#
+CNST = 0x01
+VAR  = 0x02
+REL  = 0x04
+VOL  = 0x80
+
+# Collection types
+#
+PHYSICAL    = 0x00
+APPLICATION = 0x01
+
+# Endpoint types
+#
+BULK      = 0x02
+INTERRUPT = 0x03
+
+page_names = {
+    0x01:   "Generic Desktop",
+    0x07:   "Keyboard/Keypad",
+    0x08:   "LEDs",
+    0x09:   "Button",
+    0x0C:   "Consumer Devices",
+    0xFF00: "Vendor-defined",
+    0xFF31: "Vendor-defined, hid_listen"
+}
+
+
+class Field(object):
+    """A main item and the struct members it is stored in"""
+
+    def __init__(self, kind, page, usages=(), umin=None, umax=None, size=1, count=None,
+                 logical=(0, 1), flags=VAR, member=None, ctype=None):
+        self.kind = kind
+        self.page = page
+        self.usages = usages        # [(usage, member[, comment])]
+        self.umin = umin
+        self.umax = umax
+        self.size = size
+        self.count = count or len(usages)
+        self.logical = logical
+        self.flags = flags
+        self.member = member
+        self.ctype = ctype
+
+    def members(self):
+        """Return the struct members as (type, name, bits) tuples"""
+
+        if self.flags & CNST:
+            bits = self.size * self.count
+            if bits % 8:
+                return [("unsigned", "reserved", bits)]
+            return [("uint8_t", "reserved" + array(bits // 8), None)]
+
+        if self.member:
+            if self.size == 1:
+                if self.count % 8:
+                    sys.exit("bitmap %s must fill whole bytes" % self.member)
+                return [("uint8_t", self.member + array(self.count // 8), None)]
+            return [(self.ctype or "uint8_t", self.member + array(self.count), None)]
+
+        if any(u[1] is None for u in self.usages) or self.count != len(self.usages):
+            sys.exit("no struct member for usage 0x%02x" % self.usages[0][0])
+
+        if self.size == 1:
+            return [("unsigned", u[1], 1) for u in self.usages]
+
+        ctype = self.ctype or ("int8_t" if self.logical[0] < 0 else "uint8_t")
+        return [(ctype, u[1], None) for u in self.usages]
+
+
+def array(n):
+    return "[%d]" % n if n > 1 else ""
+
+
+def Bits(kind, page, usages):
+    """One bit per named usage"""
+    return Field(kind, page, usages)
+
+def Bitmap(kind, page, umin, umax, member):
+    """One bit per usage in a range"""
+    return Field(kind, page, umin=umin, umax=umax, count=umax - umin + 1, member=member)
+
+def Array(kind, page, umin, umax, count, member):
+    """Byte array of usage indices, e.g. the boot keyboard keycodes"""
+    return Field(kind, page, umin=umin, umax=umax, size=8, count=count,
+                 logical=(umin, umax), flags=0, member=member)
+
+def Values(kind, page, usages, size=8, count=None, logical=(0, 255), flags=VAR, ctype=None):
+    """One value per usage, the last usage repeats up to count"""
+    return Field(kind, page, usages, size=size, count=count, logical=logical, flags=flags, ctype=ctype)
+
+def Pad(kind, bits):
+    return Field(kind, None, size=bits, count=1, flags=CNST)
+
+
+class Collection(object):
+    def __init__(self, ctype, page, usage, name, items, report_id=None, structs={}):
+        self.ctype = ctype
+        self.page = page
+        self.usage = usage
+        self.name = name
+        self.items = items
+        self.report_id = report_id
+        self.structs = structs      # {INPUT: "struct_name", ..}
+
+    def fields(self):
+        for item in self.items:
+            if isinstance(item, Collection):
+                for f in item.fields():
+                    yield f
+            else:
+                yield item
+
+
+class Endpoint(object):
+    def __init__(self, name, addr, size, eptype, interval="0x00", size_name=None):
+        self.name = name
+        self.addr = addr
+        self.size = size
+        self.eptype = eptype
+        self.interval = interval
+        self.size_name = size_name or name + "_SIZE"
+
+
+class Interface(object):
+    def __init__(self, name, comment, cls, subclass=0, protocol=0, report=None, report_name=None,
+                 endpoints=(), extra=(), iad=None, cond=None):
+        self.name = name
+        self.comment = comment
+        self.cls = cls
+        self.subclass = subclass
+        self.protocol = protocol
+        self.report = report        # [Collection]
+        self.report_name = report_name
+        self.endpoints = endpoints
+        self.extra = extra          # class-specific descriptors [(value, comment)]
+        self.iad = iad              # (count, class, subclass, protocol)
+        self.cond = cond
+
+
+#============================================================================
+# Reports
+#
+MODIFIER_USAGES = [
+    (0xE0, "_e0_keyboard_left_control"),
+    (0xE1, "_e1_keyboard_left_shift"),
+    (0xE2, "_e2_keyboard_left_alt"),
+    (0xE3, "_e3_keyboard_left_gui"),
+    (0xE4, "_e4_keyboard_right_control"),
+    (0xE5, "_e5_keyboard_right_shift"),
+    (0xE6, "_e6_keyboard_right_alt"),
+    (0xE7, "_e7_keyboard_right_gui")
+]
+
+LED_USAGES = [
+    (0x01, "_01_num_lock"),
+    (0x02, "_02_caps_lock"),
+    (0x03, "_03_scroll_lock"),
+    (0x04, "_04_compose"),
+    (0x05, "_05_kana")
+]
+
+SYSCTRL_USAGES = [
+    (0x81, "_81_system_power_down"),
+    (0x82, "_82_system_sleep"),
+    (0x83, "_83_system_wake_up"),
+    (0xA8, "_a8_system_hibernate")
+]
+
+CONSUMER_USAGES = [
+    (0x0E9, "_e9_volume_increment"),
+    (0x0EA, "_ea_volume_decrement"),
+    (0x0E2, "_e2_mute"),
+    (0x0CD, "_cd_play_pause"),
+    (0x0B5, "_b5_scan_next_track"),
+    (0x0B6, "_b6_scan_previous_track"),
+    (0x0B7, "_b7_stop"),
+    (0x0B8, "_b8_eject"),
+
+    (0x18A, "_18a_al_email_reader"),
+    (0x221, "_221_ac_search"),
+    (0x22A, "_22a_ac_bookmarks"),
+    (0x223, "_223_ac_home"),
+    (0x224, "_224_ac_back"),
+    (0x225, "_225_ac_forward"),
+    (0x226, "_226_ac_stop"),
+    (0x227, "_227_ac_refresh"),
+
+    (0x183, "_183_al_consumer_control_configuration"),
+    (0x196, "_196_al_internet_browser"),
+    (0x192, "_192_al_calculator"),
+    (0x19E, "_19e_al_terminal_lock_screensaver"),
+    (0x194, "_194_al_local_machine_browser"),
+    (0x206, "_206_ac_minimize"),
+    (0x06F, "_6f_brightness_increment"),    # >= Win 8.1
+    (0x070, "_70_brightness_decrement")
+]
+
+DEBOUNCE_USAGES = [
+    (0x57, None, "Debounce Mode"),
+    (0x58, None, "Debounce Samples"),
+    (0x59, None, "Debounce Hold-off")
+]
+
+keyboard_report = [
+    Collection(APPLICATION, 0x01, 0x06, "Keyboard", [
+        Bits   (INPUT,  0x07, MODIFIER_USAGES),
+        Pad    (INPUT,  8),
+        Array  (INPUT,  0x07, 0x00, 0xFF, 6, "keycode"),
+        Bits   (OUTPUT, 0x08, LED_USAGES),
+        Pad    (OUTPUT, 3)
+    ], structs={ INPUT: "kb_in_report", OUTPUT: "kb_out_report" })
+]
+
+mouse_report = [
+    Collection(APPLICATION, 0x01, 0x02, "Mouse", [
+        Collection(PHYSICAL, 0x01, 0x01, "Pointer", [
+            Bitmap (INPUT, 0x09, 0x01, 0x08, "buttons"),
+            Values (INPUT, 0x01, [(0x30, "dx", "X"), (0x31, "dy", "Y"), (0x38, "dwheel", "Wheel")],
+                    logical=(-127, 127), flags=VAR | REL),
+            Values (INPUT, 0x0C, [(0x238, "dpan", "AC Pan")],
+                    logical=(-127, 127), flags=VAR | REL)
+        ])
+    ], structs={ INPUT: "tp_mouse_report" })
+]
+
+extra_report = [
+    # System control buttons
+    #
+    Collection(APPLICATION, 0x01, 0x80, "System Control", [
+        Bits   (INPUT, 0x01, SYSCTRL_USAGES),
+        Pad    (INPUT, 4)
+    ], report_id=0x01, structs={ INPUT: "kb_sysctrl_report" }),
+
+    # Media control buttons
+    #
+    Collection(APPLICATION, 0x0C, 0x01, "Consumer Control", [
+        Bits   (INPUT, 0x0C, CONSUMER_USAGES)
+    ], report_id=0x02, structs={ INPUT: "kb_consumer_report" }),
+
+    # HID detach for Bootloader (see UM0412)
+    # Does _not_ work in ST's DfuSe >= 3.0.3
+    #
+    Collection(APPLICATION, 0xFF00, 0x55, "HID Detach", [
+        Values (FEATURE, 0xFF00, [(0x55, None, "HID Detach")], flags=VAR | VOL),
+        Values (OUTPUT,  0xFF00, [(0x55, None, "HID Detach")], flags=VAR | VOL)
+    ], report_id=0x80),
+
+    # Debounce configuration (mode, samples, hold-off)
+    #
+    Collection(APPLICATION, 0xFF00, 0x56, "Debounce", [
+        Values (FEATURE, 0xFF00, DEBOUNCE_USAGES, logical=(0, 15)),
+        Values (OUTPUT,  0xFF00, DEBOUNCE_USAGES, logical=(0, 15))
+    ], report_id=0x81)
+]
+
+# Compatible with PJRC's hid_listen
+#
+debug_report = [
+    Collection(0x53, 0xFF31, 0x74, "hid_listen", [
+        Values (INPUT, 0xFF31, [(0x75, None, "Vendor-defined")], count=63)
+    ])
+]
+
+# N-key rollover keyboard, one bit per usage
+#
+nkro_report = [
+    Collection(APPLICATION, 0x01, 0x06, "Keyboard", [
+        Bitmap (INPUT,  0x07, 0x00, 0xE7, "bitmap"),
+        Bits   (OUTPUT, 0x08, LED_USAGES),
+        Pad    (OUTPUT, 3)
+    ], structs={ INPUT: "kb_nkro_report", OUTPUT: "kb_out_report" })
+]
+
+
+#============================================================================
+# Interfaces in configuration order
+#
+cdc_functional = [
+    ("0x05",                "bLength"),
+    ("0x24",                "bDescriptorType: CS_INTERFACE"),
+    ("0x00",                "bDescriptorSubtype: Header"),
+    ("0x10, 0x01",          "bcdCDC"),
+    None,
+
+    ("0x05",                "bLength"),
+    ("0x24",                "bDescriptorType: CS_INTERFACE"),
+    ("0x01",                "bDescriptorSubtype: Call Management"),
+    ("0x00",                "bmCapabilities: no call management"),
+    ("CDC_DATA_INTERFACE",  "bDataInterface"),
+    None,
+
+    ("0x04",                "bLength"),
+    ("0x24",                "bDescriptorType: CS_INTERFACE"),
+    ("0x02",                "bDescriptorSubtype: Abstract Control Management"),
+    ("0x02",                "bmCapabilities: line coding and state"),
+    None,
+
+    ("0x05",                "bLength"),
+    ("0x24",                "bDescriptorType: CS_INTERFACE"),
+    ("0x06",                "bDescriptorSubtype: Union"),
+    ("CDC_COMM_INTERFACE",  "bMasterInterface"),
+    ("CDC_DATA_INTERFACE",  "bSlaveInterface0")
+]
+
+interfaces = [
+    Interface("HID_KEYBOARD", "Keyboard, boot protocol", 0x03, 0x01, 0x01,
+        report=keyboard_report, report_name="Keyboard", endpoints=[
+            Endpoint("HID_KEYBOARD_EPIN",  0x81, 8, INTERRUPT, "HID_KEYBOARD_POLLING_INTERVAL"),
+            Endpoint("HID_KEYBOARD_EPOUT", 0x01, 8, INTERRUPT, "HID_KEYBOARD_POLLING_INTERVAL")
+        ]),
+
+    Interface("HID_MOUSE", "Mouse, boot protocol", 0x03, 0x01, 0x02,
+        report=mouse_report, report_name="Mouse", endpoints=[
+            Endpoint("HID_MOUSE_EPIN", 0x82, 5, INTERRUPT, "HID_MOUSE_POLLING_INTERVAL")
+        ]),
+
+    Interface("HID_EXTRA", "System and consumer control, configuration", 0x03,
+        report=extra_report, report_name="Extra", endpoints=[
+            Endpoint("HID_EXTRA_EPIN",  0x83, 4, INTERRUPT, "HID_EXTRA_POLLING_INTERVAL"),
+            Endpoint("HID_EXTRA_EPOUT", 0x03, 8, INTERRUPT, "HID_EXTRA_POLLING_INTERVAL")
+        ]),
+
+    # The CDC console replaces the HID debug interface
+    #
+    Interface("CDC_COMM", "CDC-ACM console, communication", 0x02, 0x02, 0x01,
+        iad=(2, 0x02, 0x02, 0x01), extra=cdc_functional, cond="USB_CDC_CONSOLE", endpoints=[
+            Endpoint("CDC_CMD_EPIN", 0x84, 8, INTERRUPT, "CDC_CMD_POLLING_INTERVAL")
+        ]),
+
+    Interface("CDC_DATA", "CDC-ACM console, data", 0x0A, cond="USB_CDC_CONSOLE", endpoints=[
+            Endpoint("CDC_DATA_EPIN",  0x87, 64, BULK, size_name="CDC_DATA_EP_SIZE"),
+            Endpoint("CDC_DATA_EPOUT", 0x07, 64, BULK, size_name="CDC_DATA_EP_SIZE")
+        ]),
+
+    Interface("HID_DEBUG", "Debug output", 0x03,
+        report=debug_report, report_name="Debug", cond="!USB_CDC_CONSOLE", endpoints=[
+            Endpoint("HID_DEBUG_EPIN", 0x84, 64, INTERRUPT, "HID_DEBUG_POLLING_INTERVAL")
+        ]),
+
+    Interface("HID_NKRO", "N-key rollover keyboard", 0x03,
+        report=nkro_report, report_name="Nkro", endpoints=[
+            Endpoint("HID_NKRO_EPIN", 0x85, 32, INTERRUPT, "HID_NKRO_POLLING_INTERVAL")
+        ]),
+
+    Interface("HID_TELEMETRY", "Telemetry stream, vendor class", 0xFF, endpoints=[
+            Endpoint("HID_TELEMETRY_EPIN",  0x86, 64, BULK, size_name="HID_TELEMETRY_EP_SIZE"),
+            Endpoint("HID_TELEMETRY_EPOUT", 0x06, 64, BULK, size_name="HID_TELEMETRY_EP_SIZE")
+        ])
+]
+
+CFG_ATTRIBUTES  = 0xA0      # bus powered, remote wakeup
+CFG_MAX_POWER   = 0x32      # 100 mA
+
+EP0_SIZE        = 64
+PMA_SIZE        = 1024
+
+variants = [("USB_CDC_CONSOLE", True), ("!USB_CDC_CONSOLE", False)]
+
+
+#============================================================================
+# Report descriptors
+#
+class ReportWriter(object):
+    """Emit short items, skipping globals that don't change"""
+
+    def __init__(self):
+        self.lines = []
+        self.depth = 0
+        self.state = {}
+
+    def item(self, prefix, value, text, signed=False, force=False):
+        if value is None:
+            data = []
+        elif signed:
+            n = 1 if -128 <= value < 128 else 2 if -32768 <= value < 32768 else 4
+            data = [(value >> (8 * i)) & 255 for i in range(n)]
+        else:
+            n = 1 if value < 0x100 else 2 if value < 0x10000 else 4
+            data = [(value >> (8 * i)) & 255 for i in range(n)]
+
+        size = { 0: 0, 1: 1, 2: 2, 4: 3 }[len(data)]
+        bytes_ = ", ".join("0x%02X" % b for b in [prefix | size] + data) + ","
+
+        self.lines.append("    %-20s// %s%s" % (bytes_, "    " * self.depth, text))
+
+    def glob(self, prefix, value, text, signed=False):
+        if self.state.get(prefix) == value:
+            return
+        self.state[prefix] = value
+        self.item(prefix, value, text, signed)
+
+    def page(self, page):
+        self.glob(0x04, page, "Usage Page (%s)" % page_names.get(page, "0x%04X" % page))
+
+    def collection(self, c):
+        self.page(c.page)
+        self.item(0x08, c.usage, "Usage (%s)" % c.name)
+
+        ctype = { PHYSICAL: "Physical", APPLICATION: "Application" }.get(c.ctype, "0x%02X" % c.ctype)
+        self.item(0xA0, c.ctype, "Collection (%s)" % ctype)
+        self.depth += 1
+
+        if c.report_id is not None:
+            self.glob(0x84, c.report_id, "Report ID (%d)" % c.report_id)
+
+        for item in c.items:
+            if isinstance(item, Collection):
+                self.collection(item)
+            else:
+                self.field(item)
+
+        self.depth -= 1
+        self.item(0xC0, None, "End Collection")
+
+    def field(self, f):
+        if not f.flags & CNST:
+            self.page(f.page)
+
+            usages = [u[0] for u in f.usages]
+            if f.umin is not None:
+                self.item(0x18, f.umin, "Usage Minimum (0x%02X)" % f.umin)
+                self.item(0x28, f.umax, "Usage Maximum (0x%02X)" % f.umax)
+            elif len(usages) > 1 and usages == list(range(usages[0], usages[0] + len(usages))):
+                self.item(0x18, usages[0],  "Usage Minimum (%s)" % usage_text(f.usages[0]))
+                self.item(0x28, usages[-1], "Usage Maximum (%s)" % usage_text(f.usages[-1]))
+            else:
+                for u in f.usages:
+                    self.item(0x08, u[0], "Usage (%s)" % usage_text(u))
+
+            self.glob(0x14, f.logical[0], "Logical Minimum (%d)" % f.logical[0], signed=True)
+            self.glob(0x24, f.logical[1], "Logical Maximum (%d)" % f.logical[1], signed=True)
+
+        self.glob(0x74, f.size,  "Report Size (%d)" % f.size)
+        self.glob(0x94, f.count, "Report Count (%d)" % f.count)
+
+        flags = [
+            "Cnst" if f.flags & CNST else "Data",
+            "Var"  if f.flags & VAR  else "Ary",
+            "Rel"  if f.flags & REL  else "Abs"
+        ] + (["Vol"] if f.flags & VOL else [])
+
+        kind = { INPUT: "Input", OUTPUT: "Output", FEATURE: "Feature" }[f.kind]
+        self.item(f.kind, f.flags, "%s (%s)" % (kind, ",".join(flags)))
+
+
+def usage_text(u):
+    if len(u) > 2:
+        return u[2]
+    if u[1]:
+        words = re.sub(r"^_[0-9a-f]+_", "", u[1]).split("_")
+        return " ".join(w.upper() if w in ("al", "ac", "gui") else w.title() for w in words)
+    return "0x%02X" % u[0]
+
+
+def report_descriptor(report):
+    w = ReportWriter()
+    for c in report:
+        w.state = {}        # every top-level collection is self-contained
+        w.collection(c)
+
+    size = sum(len(line.split("//")[0].split(",")) - 1 for line in w.lines)
+    return w.lines, size
+
+
+#============================================================================
+# Report structs
+#
+def report_structs(report, structs):
+    """Collect struct members by struct name"""
+
+    for c in report:
+        for kind, name in c.structs.items():
+            members = []
+            if c.report_id is not None:
+                members.append((None, [("uint8_t", "report_id_%02x" % c.report_id, None)]))
+
+            for f in c.fields():
+                if f.kind == kind:
+                    members.append((f.page, f.members()))
+
+            bits = sum(b if b else 8 * member_bytes(t, n)
+                       for _, ms in members for t, n, b in ms)
+            if bits % 8:
+                sys.exit("struct %s is not a whole number of bytes" % name)
+
+            if name in structs and structs[name] != members:
+                sys.exit("struct %s defined differently by two reports" % name)
+
+            structs[name] = members
+
+
+def member_bytes(ctype, name):
+    m = re.search(r"\[(\d+)\]", name)
+    return int(m.group(1)) if m else 1
+
+
+def format_struct(name, members):
+    bitfields = [n for _, ms in members for t, n, b in ms if b]
+    width = max(len(n) for n in bitfields) if bitfields else 0
+
+    lines = ["struct %s {" % name]
+    last_page = None
+
+    for page, ms in members:
+        if page is not None and page != last_page:
+            if len(lines) > 1:
+                lines.append("")
+            lines.append("    // Usage Page 0x%02X %s" % (page, page_names.get(page, "")))
+            lines.append("    //")
+            last_page = page
+
+        for ctype, n, bits in ms:
+            if bits:
+                lines.append("    %-8s %-*s : %d;" % (ctype, width, n, bits))
+            else:
+                lines.append("    %-8s %s;" % (ctype, n))
+
+    lines.append("};")
+    return lines
+
+
+#============================================================================
+# Configuration descriptor
+#
+def active(cond, cdc):
+    return cond is None or (cond == "USB_CDC_CONSOLE") == cdc
+
+
+def descriptor_bytes(value):
+    return 2 if value.startswith("WORD(") else len(value.split(","))
+
+
+def interface_descriptor(i):
+    d = []
+    if i.iad:
+        d += [
+            ("0x08",                    "bLength"),
+            ("0x0B",                    "bDescriptorType: Interface Association"),
+            (i.name + "_INTERFACE",     "bFirstInterface"),
+            ("0x%02X" % i.iad[0],       "bInterfaceCount"),
+            ("0x%02X" % i.iad[1],       "bFunctionClass"),
+            ("0x%02X" % i.iad[2],       "bFunctionSubClass"),
+            ("0x%02X" % i.iad[3],       "bFunctionProtocol"),
+            ("0x00",                    "iFunction"),
+            None
+        ]
+
+    d += [
+        ("USB_LEN_IF_DESC",             "bLength"),
+        ("USB_DESC_TYPE_INTERFACE",     "bDescriptorType"),
+        (i.name + "_INTERFACE",         "bInterfaceNumber"),
+        ("0x00",                        "bAlternateSetting"),
+        ("0x%02X" % len(i.endpoints),   "bNumEndpoints"),
+        ("0x%02X" % i.cls,              "bInterfaceClass"),
+        ("0x%02X" % i.subclass,         "bInterfaceSubClass"),
+        ("0x%02X" % i.protocol,         "bInterfaceProtocol"),
+        ("0x00",                        "iInterface"),
+        None
+    ]
+
+    if i.report:
+        d += hid_descriptor(i) + [None]
+
+    if i.extra:
+        d += i.extra + [None]
+
+    for ep in i.endpoints:
+        d += [
+            ("USB_LEN_EP_DESC",         "bLength"),
+            ("USB_DESC_TYPE_ENDPOINT",  "bDescriptorType"),
+            (ep.name + "_ADDR",         "bEndpointAddress"),
+            ("0x%02X" % ep.eptype,      "bmAttributes: " + ("Interrupt" if ep.eptype == INTERRUPT else "Bulk")),
+            ("WORD(%s)" % ep.size_name, "wMaxPacketSize"),
+            (ep.interval,               "bInterval"),
+            None
+        ]
+
+    return d
+
+
+def hid_descriptor(i):
+    return [
+        ("USB_LEN_HID_DESC",            "bLength"),
+        ("HID_DESCRIPTOR_TYPE",         "bDescriptorType"),
+        ("0x11, 0x01",                  "bcdHID"),
+        ("0x00",                        "bCountryCode"),
+        ("0x01",                        "bNumDescriptors"),
+        ("HID_REPORT_DESC",             "bDescriptorType"),
+        ("WORD(%s)" % report_size_name(i), "wItemLength")
+    ]
+
+
+def report_size_name(i):
+    return "HID_%s_REPORT_DESC_SIZE" % i.report_name.upper()
+
+
+def format_fields(fields):
+    lines = []
+    for f in fields:
+        if f is None:
+            lines.append("")
+        else:
+            value = f[0] + ","
+            lines.append("    %s// %s" % (value.ljust(max(36, len(value) + 1)), f[1]))
+    return lines
+
+
+def config_descriptor():
+    d = [
+        ("USB_LEN_CFG_DESC",                "bLength"),
+        ("USB_DESC_TYPE_CONFIGURATION",     "bDescriptorType"),
+        ("WORD(USB_HID_CONFIG_DESC_SIZ)",   "wTotalLength"),
+        ("USB_NUM_INTERFACES",              "bNumInterfaces"),
+        ("0x01",                            "bConfigurationValue"),
+        ("0x00",                            "iConfiguration"),
+        ("0x%02X" % CFG_ATTRIBUTES,         "bmAttributes: bus powered, remote wakeup"),
+        ("0x%02X" % CFG_MAX_POWER,          "MaxPower: %d mA" % (CFG_MAX_POWER * 2)),
+        None
+    ]
+
+    lines = format_fields(d)
+    sizes = dict((cdc, fields_size(d)) for _, cdc in variants)
+
+    for i, cond_lines in conditional(interfaces, lambda i:
+            ["    // " + i.comment, "    //"] + format_fields(interface_descriptor(i))):
+        lines += cond_lines
+
+    for i in interfaces:
+        for _, cdc in variants:
+            if active(i.cond, cdc):
+                sizes[cdc] += fields_size(interface_descriptor(i))
+
+    return lines, sizes
+
+
+def fields_size(fields):
+    return sum(descriptor_bytes(f[0]) for f in fields if f)
+
+
+def conditional(items, fmt):
+    """Wrap runs of items with the same condition in #if .. #else .. #endif"""
+
+    open_cond = None
+    for item in items:
+        lines = []
+        if item.cond != open_cond:
+            if open_cond and item.cond == negate(open_cond):
+                lines.append("#else")
+            else:
+                if open_cond:
+                    lines.append("#endif")
+                if item.cond:
+                    lines.append("#if " + item.cond)
+            open_cond = item.cond
+
+        yield item, lines + fmt(item)
+
+    if open_cond:
+        yield None, ["#endif"]
+
+
+def negate(cond):
+    return cond[1:] if cond.startswith("!") else "!" + cond
+
+
+#============================================================================
+# Output
+#
+def variant_defines(cdc, report_sizes, config_size):
+    d = []
+    ifnum = 0
+    for i in interfaces:
+        if active(i.cond, cdc):
+            d.append((i.name + "_INTERFACE", str(ifnum)))
+            ifnum += 1
+
+    d.append(("USB_NUM_INTERFACES", str(ifnum)))
+    d.append(("USB_HID_CONFIG_DESC_SIZ", str(config_size)))
+    return d
+
+
+def pma_table(cdc):
+    """Packet memory: buffer descriptor table, then EP0 OUT/IN, then all other endpoints"""
+
+    eps = [(0x00, EP0_SIZE), (0x80, EP0_SIZE)]
+    addrs = set()
+    for i in interfaces:
+        if active(i.cond, cdc):
+            for ep in i.endpoints:
+                if ep.addr in addrs:
+                    sys.exit("endpoint 0x%02x used twice" % ep.addr)
+                addrs.add(ep.addr)
+                eps.append((ep.addr, ep.size))
+
+    offset = 8 * num_endpoints()
+    table = []
+    for addr, size in eps:
+        table.append((addr, offset))
+        offset += (size + 7) & ~7
+
+    if offset > PMA_SIZE:
+        sys.exit("endpoint buffers need %d bytes of packet memory" % offset)
+
+    return table
+
+
+def num_endpoints():
+    return 1 + max(ep.addr & 0x7f for i in interfaces for ep in i.endpoints)
+
+
+def write_header(path, report_sizes, config_sizes):
+    out = [
+        "// Generated by usb_desc.py, do not edit",
+        "//",
+        "#pragma once",
+        "",
+        ""
+    ]
+
+    # Endpoints
+    #
+    out += ["// Endpoint addresses and packet sizes", "//"]
+    seen = {}
+    for i in interfaces:
+        for ep in i.endpoints:
+            out.append("#define %-31s 0x%02X" % (ep.name + "_ADDR", ep.addr))
+            if ep.size_name not in seen:
+                out.append("#define %-31s %d" % (ep.size_name, ep.size))
+            elif seen[ep.size_name] != ep.size:
+                sys.exit("%s has different values" % ep.size_name)
+            seen[ep.size_name] = ep.size
+        out.append("")
+
+    out += [
+        "#define %-31s %d" % ("USB_NUM_ENDPOINTS", num_endpoints()),
+        "",
+        ""
+    ]
+
+    # Interface numbers, configuration size and PMA layout
+    #
+    defs = dict((cdc, variant_defines(cdc, report_sizes, config_sizes[cdc])) for _, cdc in variants)
+    common = [d for d in defs[True] if d in defs[False]]
+
+    out += ["// Interface numbers, configuration descriptor size", "//"]
+    out += ["#define %-31s %s" % d for d in common]
+
+    for n, (cond, cdc) in enumerate(variants):
+        out.append("#if " + cond if n == 0 else "#else")
+        out += ["#define %-31s %s" % d for d in defs[cdc] if d not in common]
+
+        out.append("")
+        out.append("#define USB_PMA_TABLE(X) \\")
+        table = pma_table(cdc)
+        for k, (addr, offset) in enumerate(table):
+            out.append("    X(0x%02X, 0x%03X)%s" % (addr, offset, " \\" if k < len(table) - 1 else ""))
+    out += ["#endif", "", ""]
+
+    # Report descriptor sizes
+    #
+    out += ["// Report descriptor sizes", "//"]
+    for i in interfaces:
+        if i.report:
+            out.append("#define %-31s %d" % (report_size_name(i), report_sizes[i.name]))
+
+    write(path, out)
+
+
+def write_inc(path, reports, cfg_lines):
+    out = [
+        "// Generated by usb_desc.py, do not edit",
+        "//",
+        ""
+    ]
+
+    def report(i):
+        lines, _ = reports[i.name]
+        return [
+            "",
+            "// %s report descriptor" % i.comment,
+            "//",
+            "static uint8_t %sReportDesc[] = {" % i.report_name
+        ] + lines + ["};", ""]
+
+    def hid(i):
+        return [
+            "",
+            "static uint8_t USBD_HID_Desc_%s[USB_LEN_HID_DESC] = {" % i.report_name
+        ] + format_fields(hid_descriptor(i)) + ["};", ""]
+
+    hid_ifs = [i for i in interfaces if i.report]
+
+    for _, lines in conditional(hid_ifs, report):
+        out += lines
+
+    for _, lines in conditional(hid_ifs, hid):
+        out += lines
+
+    out += [
+        "",
+        "static uint8_t USBD_HID_CfgDesc[] = {"
+    ] + cfg_lines + [
+        "};",
+        "",
+        "STATIC_ASSERT(sizeof(USBD_HID_CfgDesc) == USB_HID_CONFIG_DESC_SIZ);"
+    ]
+
+    write(path, out)
+
+
+def write_structs(path, structs):
+    out = [
+        "// Generated by usb_desc.py, do not edit",
+        "//",
+        "#pragma once",
+        "",
+        "#include <stdint.h>",
+        ""
+    ]
+
+    for name, members in structs:
+        out += [""] + format_struct(name, members) + [""]
+
+    write(path, out)
+
+
+def write(path, lines):
+    # strip blank lines before closing braces and #endif
+    #
+    text = re.sub(r"\n\n+(};|#else|#endif)", r"\n\1", "\n".join(lines) + "\n")
+    text = re.sub(r"\n{4,}", "\n\n\n", text)
+
+    with open(path, "w") as f:
+        f.write(text)
+
+
+def main():
+    outdir = sys.argv[1]
+
+    reports = {}
+    report_sizes = {}
+    struct_dict = {}
+    struct_order = []
+
+    for i in interfaces:
+        if i.report:
+            reports[i.name] = report_descriptor(i.report)
+            report_sizes[i.name] = reports[i.name][1]
+
+            before = set(struct_dict)
+            report_structs(i.report, struct_dict)
+            struct_order += [c.structs[k] for c in i.report for k in sorted(c.structs)
+                             if c.structs[k] not in before and c.structs[k] not in struct_order]
+
+    cfg_lines, config_sizes = config_descriptor()
+
+    write_header (os.path.join(outdir, "usb_desc.h"), report_sizes, config_sizes)
+    write_inc    (os.path.join(outdir, "usb_desc.inc"), reports, cfg_lines)
+    write_structs(os.path.join(outdir, "hid_reports.h"), [(n, struct_dict[n]) for n in struct_order])
+
+
+main()